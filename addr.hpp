@@ -0,0 +1,78 @@
+#ifndef ADDR_HPP
+#define ADDR_HPP
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Socket addresses of either family, kept in a sockaddr_storage. An IPv4
+ peer of the server's dual-stack socket shows up v4-mapped (::ffff:a.b.c.d);
+ addr_bytes() maps a plain IPv4 address the same way, so a peer hashes and
+ compares alike whichever kind of socket it came in on. */
+
+//bytes of addr that sendto() and bind() take
+inline socklen_t addr_len(const struct sockaddr_storage& addr)
+{
+  return addr.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+//the host as 16 bytes of IPv6, then the port: 18 bytes in network order
+inline void addr_bytes(unsigned char out[18], const struct sockaddr_storage& addr)
+{
+  if(addr.ss_family == AF_INET6){
+    const struct sockaddr_in6* a = (const struct sockaddr_in6*)&addr;
+    memcpy(out, &a->sin6_addr, 16);
+    memcpy(out + 16, &a->sin6_port, 2);
+  }else{
+    const struct sockaddr_in* a = (const struct sockaddr_in*)&addr;
+    memset(out, 0, 10);
+    out[10] = out[11] = 0xff;
+    memcpy(out + 12, &a->sin_addr.s_addr, 4);
+    memcpy(out + 16, &a->sin_port, 2);
+  }
+}
+
+//same host and port, in either family
+inline bool addr_equal(const struct sockaddr_storage& a, const struct sockaddr_storage& b)
+{
+  unsigned char x[18], y[18];
+  addr_bytes(x, a);
+  addr_bytes(y, b);
+  return memcmp(x, y, sizeof(x)) == 0;
+}
+
+//the wildcard host of either family, as a socket bound to any address has
+inline bool addr_any(const struct sockaddr_storage& addr)
+{
+  unsigned char b[18];
+  addr_bytes(b, addr);
+  for(int i = 0; i < 16; i++){
+    if(b[i] != 0 && !(i >= 10 && i < 12 && b[i] == 0xff)){
+      return false;
+    }
+  }
+  return true;
+}
+
+//"10.0.0.1:5000" or "[::1]:5000", for logs
+inline std::string addr_str(const struct sockaddr_storage& addr)
+{
+  char host[INET6_ADDRSTRLEN];
+  char buf[INET6_ADDRSTRLEN + 8];
+  if(addr.ss_family == AF_INET6){
+    const struct sockaddr_in6* a = (const struct sockaddr_in6*)&addr;
+    inet_ntop(AF_INET6, &a->sin6_addr, host, sizeof(host));
+    snprintf(buf, sizeof(buf), "[%s]:%u", host, ntohs(a->sin6_port));
+  }else{
+    const struct sockaddr_in* a = (const struct sockaddr_in*)&addr;
+    inet_ntop(AF_INET, &a->sin_addr, host, sizeof(host));
+    snprintf(buf, sizeof(buf), "%s:%u", host, ntohs(a->sin_port));
+  }
+  return buf;
+}
+
+#endif
@@ -0,0 +1,381 @@
+/* bench: microbenchmarks for the per-packet code of the server and the
+ client, reporting time and heap allocations per operation.
+
+ It compiles the sender and receiver modules of libtransport in, each in
+ a namespace of its own, and calls their functions directly; sends go to
+ a net() that drops them, so only our own code is timed. The last two
+ benchmarks do use the kernel, over loopback, to show what segmentation
+ offload saves per segment. Each benchmark repeats until it has run for
+ -t seconds (default 0.2); a FILTER runs only the benchmarks whose names
+ contain it. */
+
+#include "tcp.hpp"
+#include "fec.hpp"
+#include "siphash.hpp"
+#include "spsc.hpp"
+#include "netio.hpp"
+#include "isn.hpp"
+#include "busypoll.hpp"
+#include "blockcache.hpp"
+#include "ecn.hpp"
+#include <iostream>
+#include <fstream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string>
+#include <new>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <netdb.h>
+#include <math.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sched.h>
+#include <signal.h>
+#include <atomic>
+#include <thread>
+#include <map>
+#include <deque>
+#include <vector>
+
+/* Every allocation in the process goes through here and is counted. The
+ benchmarks are single threaded, so a plain counter will do. They stay out
+ of line: where GCC sees into them, it takes the malloc() and free() they
+ wrap for a mismatch with new and delete. */
+long long allocations = 0;
+
+__attribute__((noinline)) void *operator new(size_t n)
+{
+    allocations++;
+    void *p = malloc(n ? n : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+__attribute__((noinline)) void *operator new[](size_t n)
+{
+    return operator new(n);
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+#include "sender.cpp"
+#include "receiver.cpp"
+
+// takes every datagram and goes nowhere
+struct nullnet : public netio {
+    ssize_t sendto(int fd, const void *buf, size_t len, int flags,
+                   const struct sockaddr *to, socklen_t tolen)
+    {
+        return len;
+    }
+
+    ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < msg->msg_iovlen; i++)
+            n += msg->msg_iov[i].iov_len;
+        return n;
+    }
+};
+
+#define GSO_SEGS 32     // segments per UDP_SEGMENT batch in kernelBenchmarks
+
+volatile uint64_t sink;     // results go here, so that no loop is optimized away
+double minTime = 0.2;
+const char *filter = NULL;
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Calls body(i) for i = 0, 1, ... until that takes minTime, then prints
+ the time and allocations per call. */
+template <typename F>
+void bench(const char *name, F body)
+{
+    if (filter != NULL && strstr(name, filter) == NULL)
+        return;
+    long iters = 1;
+    while (true)
+    {
+        long long allocs = allocations;
+        double start = now();
+        for (long i = 0; i < iters; i++)
+            body(i);
+        double secs = now() - start;
+        allocs = allocations - allocs;
+
+        if (secs >= minTime || iters >= (1L << 40))
+        {
+            printf("%-34s %12ld %10.1f ns/op %8.2f allocs/op\n", name, iters,
+                   secs * 1e9 / iters, (double)allocs / iters);
+            return;
+        }
+        // aim a little past minTime, growing at most a hundredfold
+        double scale = secs > 0 ? 1.2 * minTime / secs : 100;
+        iters = (long)(iters * (scale < 100 ? (scale > 2 ? scale : 2) : 100));
+    }
+}
+
+void segmentBenchmarks()
+{
+    unsigned char payload[proto::max_data];
+    for (int i = 0; i < proto::max_data; i++)
+        payload[i] = (unsigned char)(i * 131);
+
+    segment seg;
+    bench("segment encode 1024", [&](long i) {
+        seg.setSeqnum((uint16_t)i);
+        sink += seg.encode(payload, DATASIZE)[0];
+    });
+    segment csum;
+    csum.setFlagcsum();
+    bench("segment encode 1024 crc32c", [&](long i) {
+        csum.setSeqnum((uint16_t)i);
+        sink += csum.encode(payload, DATASIZE)[0];
+    });
+    bench("segment encode 7680 crc32c", [&](long i) {
+        csum.setSeqnum((uint16_t)i);
+        sink += csum.encode(payload, proto::max_data)[0];
+    });
+
+    unsigned char wire[proto::max_mss + HEADEREXTSIZE];
+    memcpy(wire, seg.encode(payload, DATASIZE), seg.getLength());
+    int wireLen = seg.getLength();
+    bench("segment decode 1024", [&](long i) {
+        segment r;
+        sink += r.decode(wire, wireLen) + r.getSeqnum();
+    });
+    memcpy(wire, csum.encode(payload, DATASIZE), csum.getLength());
+    int csumLen = csum.getLength();
+    bench("segment decode 1024 crc32c", [&](long i) {
+        segment r;
+        sink += r.decode(wire, csumLen) + r.getSeqnum();
+    });
+
+    segment ack;
+    bench("setReplyAck", [&](long i) {
+        seg.setSeqnum((uint16_t)i);
+        setReplyAck(seg, ack, 1024);
+        sink += ack.getAcknum();
+    });
+
+    struct sockaddr_storage local, remote;
+    memset(&local, 0, sizeof(local));
+    memset(&remote, 0, sizeof(remote));
+    struct sockaddr_in *l = (struct sockaddr_in *)&local, *r = (struct sockaddr_in *)&remote;
+    l->sin_family = r->sin_family = AF_INET;
+    l->sin_addr.s_addr = htonl(0x0a000002);
+    r->sin_addr.s_addr = htonl(0x0a000001);
+    r->sin_port = htons(5000);
+    bench("isn", [&](long i) {
+        l->sin_port = htons((uint16_t)i);
+        sink += isn(local, remote, proto::seq_space);
+    });
+    bench("conn_id", [&](long i) {
+        sink += conn_id(local, remote);
+    });
+}
+
+void clientBenchmarks()
+{
+    // half the receive buffer held, in segment-sized runs with gaps
+    memset(receiver::rwnd_map, 0, sizeof(receiver::rwnd_map));
+    for (int pos = 0; pos < RCVBUFSIZE; pos += 2 * DATASIZE)
+        receiver::mark_rwnd(pos, DATASIZE, true);
+    bench("client consecutive_acked", [&](long i) {
+        sink += receiver::consecutive_acked(proto::ring(i * DATASIZE));
+    });
+
+    receiver::mark_rwnd(0, RCVBUFSIZE, true);
+    bench("client consecutive_acked full", [&](long i) {
+        sink += receiver::consecutive_acked(proto::ring(i));
+    });
+
+    bench("client mark_rwnd 1024", [&](long i) {
+        receiver::mark_rwnd(proto::ring(i * 7), DATASIZE, (i & 1) != 0);
+    });
+
+    receiver::rwnd_cap = RCVBUFSIZE;
+    bench("client rwnd_size", [&](long i) {
+        sink += receiver::rwnd_size();
+    });
+
+    bench("client add", [&](long i) {
+        sink += receiver::add(proto::seq(i), DATASIZE);
+    });
+}
+
+void serverBenchmarks()
+{
+    netio *sys = net();
+    nullnet null;
+    set_net(&null);
+    struct sockaddr_storage addr;
+    memset(&addr, 0, sizeof(addr));
+    socklen_t addrlen = sizeof(addr);
+    unsigned char file_buf[proto::window];
+    for (int i = 0; i < proto::window; i++)
+        file_buf[i] = (unsigned char)(i * 7);
+
+    // consecutive 1024-byte segments around the ring, as the send loop does
+    sender::gso = false;
+    bench("server sendSegment 1024", [&](long i) {
+        long off = proto::ring(i * DATASIZE);
+        sender::sendSegment(-1, addr, addrlen, file_buf, file_buf + off,
+                            proto::seq(off), DATASIZE, true, false);
+    });
+    // a 7680-byte segment 1024 bytes from the end of the ring, copied in two
+    bench("server sendSegment 7680 wrap", [&](long i) {
+        sender::sendSegment(-1, addr, addrlen, file_buf, file_buf + proto::window - DATASIZE,
+                            proto::seq(i), proto::max_data, true, false);
+    });
+    sender::gso = true;
+    bench("server sendSegment 1024 gso", [&](long i) {
+        long off = proto::ring(i * DATASIZE);
+        sender::sendSegment(-1, addr, addrlen, file_buf, file_buf + off,
+                            proto::seq(off), DATASIZE, true, false);
+        if (i % 16 == 15)
+            sender::flushSegments(-1, addr, addrlen);
+    });
+    sender::flushSegments(-1, addr, addrlen);
+
+    // refill from the read-ahead ring; the file never ends
+    sender::inlineFd = open("/dev/zero", O_RDONLY);
+    if (sender::inlineFd >= 0)
+    {
+        bench("server pullFile 1024", [&](long i) {
+            sink += sender::pullFile(file_buf, DATASIZE);
+        });
+        close(sender::inlineFd);
+        sender::inlineFd = -1;
+    }
+
+    // a window's worth of send times, the oldest acknowledged as each is added
+    std::map<uint16_t, double> time_map;
+    for (int i = 0; i < 15; i++)
+        time_map[proto::seq(i * DATASIZE)] = i;
+    bench("server time_map insert+erase", [&](long i) {
+        long seq = proto::seq((i + 15) * DATASIZE);
+        time_map[(uint16_t)seq] = (double)i;
+        time_map.erase(proto::seq(seq - 15 * DATASIZE));
+    });
+    set_net(sys);
+}
+
+/* Real sends over loopback to a socket nobody reads, which the kernel
+ drops once its buffer is full: the cost of getting segments through the
+ stack, one sendto each against one sendmsg per UDP_SEGMENT batch. */
+void kernelBenchmarks()
+{
+    int rx = socket(AF_INET, SOCK_DGRAM, 0);
+    int tx = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrlen = sizeof(addr);
+    if (rx < 0 || tx < 0 || ::bind(rx, (struct sockaddr *)&addr, addrlen) == -1 ||
+        getsockname(rx, (struct sockaddr *)&addr, &addrlen) == -1)
+    {
+        perror("loopback");
+        return;
+    }
+
+    unsigned char buf[GSO_SEGS * DATASIZE];
+    memset(buf, 0x5a, sizeof(buf));
+    bench("kernel sendto 1024 per segment", [&](long i) {
+        sink += ::sendto(tx, buf, DATASIZE, 0, (struct sockaddr *)&addr, addrlen);
+    });
+
+#ifdef UDP_SEGMENT
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &addr;
+    msg.msg_namelen = addrlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t size = DATASIZE;
+    memcpy(CMSG_DATA(cm), &size, sizeof(size));
+
+    if (::sendmsg(tx, &msg, 0) == -1)
+        perror("UDP_SEGMENT");
+    else
+    {
+        // one operation is one segment, so this compares with the above
+        bench("kernel gso 1024 per segment", [&](long i) {
+            if (i % GSO_SEGS == 0)
+                sink += ::sendmsg(tx, &msg, 0);
+        });
+    }
+#endif
+    close(rx);
+    close(tx);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                minTime = atof(optarg);
+                break;
+            default:
+                error("Usage: ./bench [-t SECONDS] [FILTER]");
+        }
+    }
+    if (optind < argc)
+        filter = argv[optind];
+
+    // the protocol's own logs would swamp the numbers
+    cout.setstate(std::ios::badbit);
+    cerr.setstate(std::ios::badbit);
+
+    segmentBenchmarks();
+    clientBenchmarks();
+    serverBenchmarks();
+    kernelBenchmarks();
+    return 0;
+}
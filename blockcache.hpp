@@ -0,0 +1,264 @@
+#ifndef BLOCKCACHE_HPP
+#define BLOCKCACHE_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* A cache of file blocks shared by all the processes of a server that
+ forks one per client, so a file fetched by many clients at once is read
+ from the disk once. It lives in anonymous shared memory mapped before the
+ first fork, and one process-shared mutex guards its index; the block
+ data is copied in and out with the mutex released, under a reference
+ count that keeps the slot from being evicted meanwhile. The mutex is
+ robust, so a process that dies holding it does not wedge the others. A
+ slot being read in records the reader's pid, and a process that finds
+ the reader gone reads the block itself, so one killed in the middle of a
+ read does not leave the others waiting on that block for ever. One
+ killed in the middle of a copy leaves its reference behind, and that
+ slot is never evicted again: the cache is a block smaller, but nobody
+ waits on it.
+
+ Blocks are CACHE_BLOCKSIZE bytes at multiples of it, keyed by the file's
+ device, inode and modification time and the block's index. Eviction is
+ CLOCK: a hand sweeps the slots, clearing reference bits and taking the
+ first slot that is unreferenced and not in use. */
+
+#define CACHE_BLOCKSIZE 65536
+
+//names a version of a file
+struct cache_file {
+  uint64_t dev, ino, mtime;
+
+  bool of(int fd){
+    struct stat st;
+    if(fstat(fd, &st) == -1)
+      return false;
+    dev = st.st_dev;
+    ino = st.st_ino;
+    mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    return true;
+  }
+};
+
+class block_cache {
+  enum {EMPTY, LOADING, READY};
+
+  struct slot {
+    cache_file file;
+    long block;     // index of the block in the file
+    long len;       // bytes of it, short at the end of the file
+    int state;
+    int refs;       // copies in progress
+    pid_t loader;   // the process reading the block in, while LOADING
+    int next;       // in the hash chain, -1 at the end
+    bool referenced;
+    unsigned char data[CACHE_BLOCKSIZE];
+  };
+
+  struct shared {
+    pthread_mutex_t mu;
+    long hits, misses, evictions;   // of every process
+    int nslots;
+    int hand;
+  };
+
+  shared* sh;
+  int* buckets;     // nslots chains of slots, by hash
+  slot* slots;
+
+public:
+  long hits, misses;    // of this process
+
+  block_cache() : sh(NULL), buckets(NULL), slots(NULL), hits(0), misses(0) {}
+
+  //maps a cache of mb megabytes, to share with processes forked after
+  bool open(long mb){
+    int n = (int)(mb * 1048576 / CACHE_BLOCKSIZE);
+    if(n < 1)
+      return false;
+    size_t head = (sizeof(shared) + n * sizeof(int) + 63) & ~(size_t)63;
+    void* m = mmap(NULL, head + n * sizeof(slot), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(m == MAP_FAILED)
+      return false;
+    sh = (shared*)m;
+    buckets = (int*)(sh + 1);
+    slots = (slot*)((char*)m + head);
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&sh->mu, &attr);
+    pthread_mutexattr_destroy(&attr);
+    sh->hits = sh->misses = sh->evictions = 0;
+    sh->nslots = n;
+    sh->hand = 0;
+    for(int i = 0; i < n; i++){
+      buckets[i] = -1;
+      slots[i].state = EMPTY;
+      slots[i].refs = 0;
+      slots[i].next = -1;
+      slots[i].referenced = false;
+    }
+    return true;
+  }
+
+  bool on(){
+    return sh != NULL;
+  }
+
+  long total_hits(){ return sh->hits; }
+  long total_misses(){ return sh->misses; }
+  long total_evictions(){ return sh->evictions; }
+
+  /* Copies up to n bytes of file from offset, no further than the end of
+   the block offset is in, to dst, reading the block from fd unless it is
+   cached. @returns the bytes copied, 0 at the end of the file, or -1 */
+  long pread(int fd, const cache_file& file, long offset, unsigned char* dst, long n){
+    long block = offset / CACHE_BLOCKSIZE;
+    long skip = offset % CACHE_BLOCKSIZE;
+    slot* s = acquire(fd, file, block);
+    if(s == NULL)
+      return -1;
+    long len = s->len - skip;
+    if(len > n)
+      len = n;
+    if(len > 0)
+      memcpy(dst, s->data + skip, len);
+    release(s);
+    return len > 0 ? len : 0;
+  }
+
+private:
+  void lock(){
+    if(pthread_mutex_lock(&sh->mu) == EOWNERDEAD)
+      pthread_mutex_consistent(&sh->mu);
+  }
+
+  void unlock(){
+    pthread_mutex_unlock(&sh->mu);
+  }
+
+  int bucket(const cache_file& file, long block){
+    uint64_t h = file.ino * 0x9E3779B97F4A7C15ULL ^ file.dev ^ (uint64_t)block * 0xC2B2AE3D27D4EB4FULL;
+    return (int)((h ^ (h >> 29)) % (uint64_t)sh->nslots);
+  }
+
+  static bool same(const slot& s, const cache_file& file, long block){
+    return s.block == block && s.file.ino == file.ino && s.file.dev == file.dev &&
+           s.file.mtime == file.mtime;
+  }
+
+  void unlink(int i){
+    int* p = &buckets[bucket(slots[i].file, slots[i].block)];
+    while(*p != i)
+      p = &slots[*p].next;
+    *p = slots[i].next;
+  }
+
+  //CLOCK: the next slot neither referenced lately nor in use, -1 if all are in use
+  int victim(){
+    for(int sweep = 0; sweep < 2 * sh->nslots; sweep++){
+      int i = sh->hand;
+      sh->hand = (sh->hand + 1) % sh->nslots;
+      slot& s = slots[i];
+      if(s.refs > 0)
+        continue;
+      if(s.referenced){
+        s.referenced = false;
+        continue;
+      }
+      return i;
+    }
+    return -1;
+  }
+
+  //the slot holding the block, with a reference taken; NULL on a read error
+  slot* acquire(int fd, const cache_file& file, long block){
+    lock();
+    while(true){
+      int i = buckets[bucket(file, block)];
+      while(i != -1 && !same(slots[i], file, block))
+        i = slots[i].next;
+      if(i != -1 && slots[i].state == READY){
+        slots[i].refs++;
+        slots[i].referenced = true;
+        sh->hits++;
+        hits++;
+        unlock();
+        return &slots[i];
+      }
+      if(i != -1 && gone(slots[i].loader)){
+        // its reader died: read it in its stead, with the reference it held
+        slots[i].loader = getpid();
+        unlock();
+        return load(fd, slots[i], block);
+      }
+      if(i != -1 || (i = victim()) == -1){
+        // another process is reading it in, or every slot is being
+        // copied from: both take no longer than a read
+        unlock();
+        sched_yield();
+        lock();
+        continue;
+      }
+
+      slot& s = slots[i];
+      if(s.state != EMPTY){
+        unlink(i);
+        sh->evictions++;
+      }
+      s.file = file;
+      s.block = block;
+      s.state = LOADING;
+      s.loader = getpid();
+      s.refs = 1;
+      s.referenced = true;
+      int* head = &buckets[bucket(file, block)];
+      s.next = *head;
+      *head = i;
+      sh->misses++;
+      misses++;
+      unlock();
+      return load(fd, s, block);
+    }
+  }
+
+  //whether pid, which was reading a block in, has died since
+  static bool gone(pid_t pid){
+    return kill(pid, 0) == -1 && errno == ESRCH;
+  }
+
+  //reads the block into s, LOADING under this process; NULL on a read error
+  slot* load(int fd, slot& s, long block){
+    long len = ::pread(fd, s.data, CACHE_BLOCKSIZE, block * CACHE_BLOCKSIZE);
+    lock();
+    if(len < 0){
+      unlink((int)(&s - slots));
+      s.state = EMPTY;
+      s.refs = 0;
+      unlock();
+      return NULL;
+    }
+    s.len = len;
+    s.state = READY;
+    unlock();
+    return &s;
+  }
+
+  void release(slot* s){
+    lock();
+    s->refs--;
+    unlock();
+  }
+};
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef BUSYPOLL_HPP
+#define BUSYPOLL_HPP
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <iostream>
+#include <vector>
+#include "netio.hpp"
+
+/* Low-latency mode, trading CPU for latency. By default the server and the
+ client sleep in poll() until a datagram arrives or a timer is due. Given
+ a spin budget (-p MICROSECONDS) they first poll without sleeping for that
+ long, so a datagram that comes soon is seen without a wakeup, and ask the
+ kernel to busy-poll the device queue as well (SO_BUSY_POLL). -c pins the
+ protocol thread, and the disk thread, to the cores given.
+
+ Each datagram is stamped by the kernel as it arrives (SO_TIMESTAMPNS); the
+ time from there to the end of its handling is its latency, and the 50th
+ and 99th percentiles of it are printed at the end. They come from a
+ histogram of fixed size, so a long transfer, or a server that runs for
+ weeks, neither grows it nor allocates in the loop that fills it. */
+
+//the wall clock, which is what SO_TIMESTAMPNS stamps with
+inline double wall_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//"2" or "2,3" into cpus; false if s is no such list
+inline bool parse_cpus(const char* s, std::vector<int>& cpus)
+{
+  cpus.clear();
+  while(*s){
+    char* end;
+    long cpu = strtol(s, &end, 10);
+    if(end == s || cpu < 0 || cpu >= CPU_SETSIZE)
+      return false;
+    cpus.push_back((int)cpu);
+    if(*end != ',' && *end != '\0')
+      return false;
+    s = *end == ',' ? end + 1 : end;
+  }
+  return !cpus.empty();
+}
+
+//binds the calling thread to one core, 0 or an errno
+inline int pin_thread(int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+//SO_BUSY_POLL for spin_us on fd, where the kernel has it
+inline int busy_poll_socket(int fd, int spin_us)
+{
+#ifdef SO_BUSY_POLL
+  return net()->setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &spin_us, sizeof(spin_us));
+#else
+  (void)fd;
+  (void)spin_us;
+  errno = ENOPROTOOPT;
+  return -1;
+#endif
+}
+
+/* Polls that do not sleep, for up to spin_us: what poll() returns once
+ it is not 0, or 0 when the budget is spent. The budget is kept on the
+ real clock, because it is CPU time that is being spent, even under the
+ simulator. */
+inline int spin_wait(struct pollfd* fds, nfds_t nfds, int spin_us)
+{
+  struct timespec start, t;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do{
+    int r = net()->poll(fds, nfds, 0);
+    if(r != 0)
+      return r;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+  }while((t.tv_sec - start.tv_sec) * 1000000L + (t.tv_nsec - start.tv_nsec) / 1000 < spin_us);
+  return 0;
+}
+
+//poll() for up to ms, spinning for the first spin_us of it
+inline int busy_wait(struct pollfd* fds, nfds_t nfds, int ms, int spin_us)
+{
+  if(spin_us > 0 && ms != 0){
+    int r = spin_wait(fds, nfds, spin_us);
+    if(r != 0)
+      return r;
+  }
+  return net()->poll(fds, nfds, ms);
+}
+
+//the SO_TIMESTAMPNS arrival stamp in msg's control data, 0 if none
+inline double arrival_of(struct msghdr& msg)
+{
+  for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)){
+    if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS){
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+      return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+  }
+  return 0;
+}
+
+/* Per-datagram latencies, arrival to handled, in microseconds. Below SUB
+ microseconds the buckets are one microsecond wide; above, each power of
+ two is split into SUB, so a percentile is within 1/SUB of the latency it
+ stands for. The last bucket takes everything from 2^(OCTAVES+3) us, about
+ two minutes, on. */
+struct latency_log {
+  enum {SUB = 16, OCTAVES = 24, BUCKETS = SUB * OCTAVES};
+  unsigned long counts[BUCKETS];
+  unsigned long n;
+
+  latency_log() : n(0) { memset(counts, 0, sizeof(counts)); }
+
+  //the bucket a latency of us microseconds goes in
+  static int bucket(double us){
+    if(us < SUB)
+      return us > 0 ? (int)us : 0;
+    int e;
+    frexp(us, &e);      // 2^(e-1) <= us < 2^e
+    int b = (e - 4) * SUB + (int)(ldexp(us, 1 - e) * SUB) - SUB;
+    return b < BUCKETS ? b : BUCKETS - 1;
+  }
+
+  //the least latency bucket b holds
+  static double lower(int b){
+    if(b < SUB)
+      return b;
+    return ldexp(1 + (double)(b % SUB) / SUB, b / SUB + 3);
+  }
+
+  //the datagram that arrived at arrival (from arrival_of) is handled
+  void add(double arrival){
+    if(arrival > 0){
+      counts[bucket((wall_now() - arrival) * 1e6)]++;
+      n++;
+    }
+  }
+
+  //the p-th percentile, p in [0, 100], as the middle of its bucket
+  double percentile(double p){
+    unsigned long k = (unsigned long)(p / 100 * (n - 1) + 0.5);
+    unsigned long below = 0;
+    int b = 0;
+    while(below + counts[b] <= k)
+      below += counts[b++];
+    return (lower(b) + lower(b + 1)) / 2;
+  }
+
+  void report(std::ostream& out, const char* what){
+    if(n == 0)
+      return;
+    double p50 = percentile(50), p99 = percentile(99);
+    out << what << " latency p50 " << p50 << " us, p99 " << p99
+              << " us over " << n << " datagrams" << std::endl;
+  }
+};
+
+#endif
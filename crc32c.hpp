@@ -0,0 +1,110 @@
+#ifndef CRC32C_HPP
+#define CRC32C_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/* CRC32C (Castagnoli polynomial) used by the per-segment checksum and the
+ whole-file digest. Calls chain like zlib's crc32():
+ crc32c(crc32c(0, a, na), b, nb) == crc32c(0, ab, na+nb).
+ The hardware CRC instructions are used when the CPU has them, otherwise a
+ slicing-by-8 table does eight bytes per step. */
+
+#define CRC32C_POLY 0x82F63B78
+
+struct crc32c_table {
+  uint32_t t[8][256];
+
+  crc32c_table(){
+    for (int i = 0; i < 256; i++){
+      uint32_t crc = i;
+      for (int k = 0; k < 8; k++)
+        crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+      t[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++)
+      for (int k = 1; k < 8; k++)
+        t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xFF];
+  }
+};
+
+inline uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t n)
+{
+  static const crc32c_table tab;
+  const uint32_t (*t)[256] = tab.t;
+
+  while (n >= 8){
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p+4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    lo = __builtin_bswap32(lo);
+    hi = __builtin_bswap32(hi);
+#endif
+    lo ^= crc;
+    crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^
+          t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+          t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+          t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    p += 8;
+    n -= 8;
+  }
+  while (n--)
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t n)
+{
+  uint64_t c = crc;
+  while (n >= 8){
+    uint64_t v;
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+    p += 8;
+    n -= 8;
+  }
+  crc = (uint32_t)c;
+  while (n--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+inline uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t n)
+{
+  while (n >= 8){
+    uint64_t v;
+    memcpy(&v, p, 8);
+    crc = __crc32cd(crc, v);
+    p += 8;
+    n -= 8;
+  }
+  while (n--)
+    crc = __crc32cb(crc, *p++);
+  return crc;
+}
+#endif
+
+inline uint32_t crc32c(uint32_t crc, const unsigned char* p, size_t n)
+{
+#if defined(__x86_64__)
+  static const bool hw = __builtin_cpu_supports("sse4.2");
+  if (hw)
+    return ~crc32c_hw(~crc, p, n);
+#elif defined(__ARM_FEATURE_CRC32)
+  return ~crc32c_hw(~crc, p, n);
+#endif
+  return ~crc32c_sw(~crc, p, n);
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef ECN_HPP
+#define ECN_HPP
+
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include "netio.hpp"
+
+/* Explicit Congestion Notification (RFC 3168) for datagrams. The server
+ sends its datagrams ECN-capable (ECT(0) in the low bits of the IPv4 TOS
+ byte or the IPv6 traffic class), so a router whose queue builds up can
+ mark them CE instead of dropping them. The client reads the field of
+ every datagram it receives from the control data, and echoes a mark in
+ its ACKs (RSV_ECE) until the server says it has cut its window
+ (RSV_CWR). Either option may fail on one family of a socket; the other
+ is the one that counts. */
+
+#define ECN_MASK 0x03
+#define ECN_ECT0 0x02
+#define ECN_CE 0x03
+
+//sends the datagrams of fd ECN-capable; -1 if neither family takes it
+inline int set_ect(int fd)
+{
+  int tos = ECN_ECT0;
+  int v4 = net()->setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+  int v6 = net()->setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
+  return v4 == 0 || v6 == 0 ? 0 : -1;
+}
+
+//asks for the ECN field of every datagram fd receives; -1 if it cannot
+inline int recv_ecn(int fd)
+{
+  int on = 1;
+  int v4 = net()->setsockopt(fd, IPPROTO_IP, IP_RECVTOS, &on, sizeof(on));
+  int v6 = net()->setsockopt(fd, IPPROTO_IPV6, IPV6_RECVTCLASS, &on, sizeof(on));
+  return v4 == 0 || v6 == 0 ? 0 : -1;
+}
+
+//the ECN field of the datagram msg holds, from its control data; 0 if none
+inline int ecn_of(struct msghdr& msg)
+{
+  for(struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)){
+    // a byte for IPv4, an int for IPv6
+    if(cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_TOS)
+      return *(unsigned char*)CMSG_DATA(cm) & ECN_MASK;
+    if(cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_TCLASS){
+      int tclass;
+      memcpy(&tclass, CMSG_DATA(cm), sizeof(tclass));
+      return tclass & ECN_MASK;
+    }
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef FEC_HPP
+#define FEC_HPP
+
+#include "tcp.hpp"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* XOR forward error correction. After every block of consecutive data
+ segments the sender sends one repair segment (RSV_FEC set) with
+   seqNo:   sequence number of the first byte of the block
+   ackNo:   sequence number just past the last byte of the block
+   rcvWin:  stride, the payload size of every segment but the last,
+            which may be shorter
+   payload: XOR of their payloads, each zero-padded to the stride.
+ A receiver holding all but one segment of the block rebuilds the missing
+ one without waiting a round trip for the retransmission. Only segments
+ that match the block's layout exactly are used, so retransmissions cut
+ at another segment size never feed a rebuild. Repair segments take no
+ sequence space and are never acknowledged. */
+
+#define FEC_MAXK 15       // most data segments covered by one repair segment
+#define FEC_HISTORY 30    // data segments the receiver keeps for rebuilding
+#define FEC_MAXBLOCK proto::window  // bytes a block may span, so that
+                                    // ackNo - seqNo is unambiguous
+
+//dst ^= src over n bytes, 64 bytes per step where SIMD is available
+inline void xor_into(unsigned char* dst, const unsigned char* src, int n)
+{
+  int i = 0;
+#if defined(__SSE2__)
+  for ( ; i + 64 <= n; i += 64){
+    __m128i a0 = _mm_loadu_si128((const __m128i*)(dst+i));
+    __m128i a1 = _mm_loadu_si128((const __m128i*)(dst+i+16));
+    __m128i a2 = _mm_loadu_si128((const __m128i*)(dst+i+32));
+    __m128i a3 = _mm_loadu_si128((const __m128i*)(dst+i+48));
+    a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i*)(src+i)));
+    a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i*)(src+i+16)));
+    a2 = _mm_xor_si128(a2, _mm_loadu_si128((const __m128i*)(src+i+32)));
+    a3 = _mm_xor_si128(a3, _mm_loadu_si128((const __m128i*)(src+i+48)));
+    _mm_storeu_si128((__m128i*)(dst+i), a0);
+    _mm_storeu_si128((__m128i*)(dst+i+16), a1);
+    _mm_storeu_si128((__m128i*)(dst+i+32), a2);
+    _mm_storeu_si128((__m128i*)(dst+i+48), a3);
+  }
+  for ( ; i + 16 <= n; i += 16){
+    __m128i a = _mm_loadu_si128((const __m128i*)(dst+i));
+    a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i*)(src+i)));
+    _mm_storeu_si128((__m128i*)(dst+i), a);
+  }
+#elif defined(__ARM_NEON)
+  for ( ; i + 16 <= n; i += 16){
+    vst1q_u8(dst+i, veorq_u8(vld1q_u8(dst+i), vld1q_u8(src+i)));
+  }
+#endif
+  for ( ; i < n; i++){
+    dst[i] ^= src[i];
+  }
+}
+
+//the sender's parity for the block being sent
+struct fec_encoder {
+  unsigned char parity[proto::max_data];
+  uint16_t start;   // sequence number of the first byte in the block
+  uint16_t end;     // sequence number just past the block
+  int stride;       // payload size of the first segment
+  int lastlen;      // payload size of the latest segment
+  int k;            // segments this block will cover
+  int count;        // segments folded in so far
+
+  fec_encoder(){
+    k = FEC_MAXK;
+    reset();
+  }
+
+  void reset(){
+    count = 0;
+    stride = 0;
+    lastlen = 0;
+    memset(parity, 0, proto::max_data);
+  }
+
+  //false if a segment of len bytes cannot join the block and it must be sent first
+  bool fits(int len){
+    return count == 0 || (lastlen == stride && len <= stride &&
+                          count * stride + len <= FEC_MAXBLOCK);
+  }
+
+  void add(uint16_t seq, const unsigned char* data, int len){
+    if(count == 0){
+      start = seq;
+      stride = len;
+    }
+    xor_into(parity, data, len);
+    end = proto::seq(seq + len);
+    lastlen = len;
+    count++;
+  }
+};
+
+//the receiver's copies of the last FEC_HISTORY data segments it got
+struct fec_decoder {
+  long offset[FEC_HISTORY];  // stream offset of the segment held, -1 if none
+  int len[FEC_HISTORY];
+  unsigned char data[FEC_HISTORY][proto::max_data];
+  int next;                  // slot to overwrite next
+
+  fec_decoder(){
+    reset();
+  }
+
+  void reset(){
+    next = 0;
+    for (int i = 0; i < FEC_HISTORY; i++){
+      offset[i] = -1;
+    }
+  }
+
+  //@returns the slot holding exactly this segment, -1 if none
+  int find(long off, int n){
+    for (int i = 0; i < FEC_HISTORY; i++){
+      if(offset[i] == off && len[i] == n){
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  void store(long off, const unsigned char* d, int n){
+    if(off < 0 || find(off, n) >= 0){
+      return;
+    }
+    offset[next] = off;
+    len[next] = n;
+    memcpy(data[next], d, n);
+    next = (next + 1) % FEC_HISTORY;
+  }
+
+  /* Rebuilds the one segment missing from the block of blocklen bytes at
+   stream offset start. Fills out, outoff and outlen and returns true, or
+   returns false if no segment or more than one is missing. */
+  bool rebuild(long start, int blocklen, int stride, const unsigned char* parity,
+               int plen, unsigned char* out, long &outoff, int &outlen){
+    if(start < 0 || stride <= 0 || stride > proto::max_data || plen != stride ||
+       blocklen <= 0 || blocklen > FEC_MAXK * stride || blocklen > FEC_MAXBLOCK){
+      return false;
+    }
+    int k = (blocklen + stride - 1) / stride;
+    int slot[FEC_MAXK];
+    int missing = -1;
+    for (int j = 0; j < k; j++){
+      int n = (j == k - 1) ? blocklen - j * stride : stride;
+      slot[j] = find(start + (long)j * stride, n);
+      if(slot[j] < 0){
+        if(missing >= 0){
+          return false;
+        }
+        missing = j;
+      }
+    }
+    if(missing < 0){
+      return false;
+    }
+
+    memcpy(out, parity, plen);
+    for (int j = 0; j < k; j++){
+      if(j != missing){
+        xor_into(out, data[slot[j]], len[slot[j]]);
+      }
+    }
+    outoff = start + (long)missing * stride;
+    outlen = (missing == k - 1) ? blocklen - missing * stride : stride;
+    return true;
+  }
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef ISN_HPP
+#define ISN_HPP
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <netinet/in.h>
+#include "siphash.hpp"
+#include "netio.hpp"
+#include "addr.hpp"
+
+/* Initial sequence numbers and connection IDs after RFC 6528: a keyed hash
+ F of the local and remote address and port, plus a clock M. F is secret
+ to the process, so one connection's ISN says nothing about another's; M
+ moves the ISN of a new connection on the same four-tuple on from the old
+ one's. The key comes once from net()->key(), and M from net()->now(), so
+ that under the simulator both are reproducible. */
+
+#define ISN_TICKS_PER_SEC 1000  // M: one a millisecond, a lap of 15-bit numbers every 33 s
+
+//the key shared by isn() and conn_id(), drawn on first use
+inline const uint64_t* isn_key()
+{
+  struct secret {
+    uint64_t key[2];
+    secret(){ net()->key(key); }
+  };
+  static secret s;
+  return s.key;
+}
+
+//the four-tuple as SipHash input, 36 bytes in network order
+inline void isn_tuple(unsigned char msg[36], const struct sockaddr_storage& local,
+                      const struct sockaddr_storage& remote)
+{
+  addr_bytes(msg, local);
+  addr_bytes(msg + 18, remote);
+}
+
+//the initial sequence number for a connection from local to remote, below space
+inline uint16_t isn(const struct sockaddr_storage& local, const struct sockaddr_storage& remote,
+                    long space)
+{
+  unsigned char msg[36];
+  isn_tuple(msg, local, remote);
+  uint64_t m = (uint64_t)(net()->now() * ISN_TICKS_PER_SEC);
+  return (uint16_t)((m + siphash24(isn_key(), msg, sizeof(msg))) % space);
+}
+
+/* A 64-bit name for a connection, for tables of them and for logs. Besides
+ the four-tuple and the clock it hashes a count of the IDs handed out, so
+ no two in a process share their input, and two alike are as unlikely as
+ a SipHash collision. */
+inline uint64_t conn_id(const struct sockaddr_storage& local, const struct sockaddr_storage& remote)
+{
+  static std::atomic<uint64_t> issued(0);
+  unsigned char msg[52];
+  isn_tuple(msg, local, remote);
+  uint64_t ns = (uint64_t)(net()->now() * 1e9);
+  uint64_t n = issued.fetch_add(1, std::memory_order_relaxed);
+  for (int i = 0; i < 8; i++){
+    msg[36 + i] = (ns >> (8 * i)) & 0xFF;
+    msg[44 + i] = (n >> (8 * i)) & 0xFF;
+  }
+  return siphash24(isn_key(), msg, sizeof(msg));
+}
+
+#endif
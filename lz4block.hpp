@@ -0,0 +1,201 @@
+#ifndef LZ4BLOCK_HPP
+#define LZ4BLOCK_HPP
+
+#include <stdint.h>
+#include <cstring>
+
+/* A small, dictionary-free compressor for single segments, writing the LZ4
+ block format (so any LZ4 block decoder can read it). Every block is
+ self-contained: a segment decodes on its own, whatever else was lost.
+ It does one hash probe per position, which keeps it fast enough to run on
+ every segment. Blocks must be smaller than 64 KB. */
+
+#define LZ4_MINMATCH 4
+#define LZ4_LASTLITERALS 5  // the last 5 bytes are always literals
+#define LZ4_MFLIMIT 12      // no match may start in the last 12 bytes
+#define LZ4_HASHLOG 10
+
+inline uint32_t lz4_read32(const unsigned char* p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+inline uint32_t lz4_hash(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - LZ4_HASHLOG);
+}
+
+//writes a literal or match length continuation, returns false if out of room
+inline bool lz4_put_length(unsigned char*& op, unsigned char* oend, int len)
+{
+  for ( ; len >= 255; len -= 255){
+    if(op >= oend){
+      return false;
+    }
+    *op++ = 255;
+  }
+  if(op >= oend){
+    return false;
+  }
+  *op++ = (unsigned char)len;
+  return true;
+}
+
+/* Compresses n bytes of src into dst, which has room for cap bytes.
+ Returns the compressed size, or 0 if the result would not fit in cap
+ (the caller should then send the data uncompressed). */
+inline int lz4_compress(const unsigned char* src, int n, unsigned char* dst, int cap)
+{
+  uint16_t table[1 << LZ4_HASHLOG];   // position+1 of the last 4 bytes seen, 0 if none
+  memset(table, 0, sizeof(table));
+
+  unsigned char* op = dst;
+  unsigned char* oend = dst + cap;
+  int anchor = 0;
+  int ip = 0;
+
+  if(n > LZ4_MFLIMIT){
+    int matchlimit = n - LZ4_LASTLITERALS;
+    while(ip < n - LZ4_MFLIMIT){
+      uint32_t seq = lz4_read32(src+ip);
+      uint32_t h = lz4_hash(seq);
+      int ref = (int)table[h] - 1;
+      table[h] = (uint16_t)(ip + 1);
+      if(ref < 0 || lz4_read32(src+ref) != seq){
+        ip++;
+        continue;
+      }
+
+      //extend the match backwards over pending literals, then forwards
+      while(ip > anchor && ref > 0 && src[ip-1] == src[ref-1]){
+        ip--;
+        ref--;
+      }
+      int mlen = LZ4_MINMATCH;
+      while(ip + mlen < matchlimit && src[ip+mlen] == src[ref+mlen]){
+        mlen++;
+      }
+
+      int litlen = ip - anchor;
+      if(op + 1 + litlen + 2 > oend){
+        return 0;
+      }
+      unsigned char* token = op++;
+      *token = (unsigned char)(((litlen < 15 ? litlen : 15) << 4) |
+                               (mlen - LZ4_MINMATCH < 15 ? mlen - LZ4_MINMATCH : 15));
+      if(litlen >= 15 && !lz4_put_length(op, oend, litlen - 15)){
+        return 0;
+      }
+      if(op + litlen + 2 > oend){
+        return 0;
+      }
+      memcpy(op, src+anchor, litlen);
+      op += litlen;
+      int offset = ip - ref;
+      *op++ = offset & 0xFF;
+      *op++ = (offset >> 8) & 0xFF;
+      if(mlen - LZ4_MINMATCH >= 15 && !lz4_put_length(op, oend, mlen - LZ4_MINMATCH - 15)){
+        return 0;
+      }
+
+      ip += mlen;
+      anchor = ip;
+    }
+  }
+
+  //last literals
+  int litlen = n - anchor;
+  if(op + 1 > oend){
+    return 0;
+  }
+  *op++ = (unsigned char)((litlen < 15 ? litlen : 15) << 4);
+  if(litlen >= 15 && !lz4_put_length(op, oend, litlen - 15)){
+    return 0;
+  }
+  if(op + litlen > oend){
+    return 0;
+  }
+  memcpy(op, src+anchor, litlen);
+  op += litlen;
+  return (int)(op - dst);
+}
+
+//reads a length continuation, returns -1 if it runs past the input
+inline int lz4_get_length(const unsigned char*& ip, const unsigned char* iend)
+{
+  int len = 0;
+  unsigned char b;
+  do {
+    if(ip >= iend){
+      return -1;
+    }
+    b = *ip++;
+    len += b;
+  } while(b == 255);
+  return len;
+}
+
+/* Decompresses an n byte block from src into dst, which has room for cap
+ bytes. Returns the decompressed size, or -1 if the block is malformed. */
+inline int lz4_decompress(const unsigned char* src, int n, unsigned char* dst, int cap)
+{
+  const unsigned char* ip = src;
+  const unsigned char* iend = src + n;
+  unsigned char* op = dst;
+  unsigned char* oend = dst + cap;
+
+  while(ip < iend){
+    unsigned char token = *ip++;
+
+    int litlen = token >> 4;
+    if(litlen == 15){
+      int more = lz4_get_length(ip, iend);
+      if(more < 0){
+        return -1;
+      }
+      litlen += more;
+    }
+    if(litlen > iend - ip || litlen > oend - op){
+      return -1;
+    }
+    memcpy(op, ip, litlen);
+    op += litlen;
+    ip += litlen;
+    if(ip == iend){
+      break;  //the last sequence has no match
+    }
+
+    if(iend - ip < 2){
+      return -1;
+    }
+    int offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if(offset == 0 || offset > op - dst){
+      return -1;
+    }
+
+    int mlen = token & 15;
+    if(mlen == 15){
+      int more = lz4_get_length(ip, iend);
+      if(more < 0){
+        return -1;
+      }
+      mlen += more;
+    }
+    mlen += LZ4_MINMATCH;
+    if(mlen > oend - op){
+      return -1;
+    }
+    //byte by byte: the match may overlap the bytes it produces
+    const unsigned char* match = op - offset;
+    for (int i = 0; i < mlen; i++){
+      op[i] = match[i];
+    }
+    op += mlen;
+  }
+  return (int)(op - dst);
+}
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef NETIO_HPP
+#define NETIO_HPP
+
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include "siphash.hpp"
+
+/* Everything the protocol asks of the outside world: datagram I/O, the
+ clock and secret keys. The server and the client reach it through net(),
+ which is the real thing unless the network simulator (netsim.cpp) has
+ installed an implementation of its own with set_net(). Under the
+ simulator time is virtual and the disk pipelines run on the protocol
+ thread, so that a transfer is reproducible to the last packet. */
+
+struct netio {
+  virtual ~netio() {}
+
+  virtual ssize_t sendto(int fd, const void* buf, size_t len, int flags,
+                         const struct sockaddr* to, socklen_t tolen){
+    return ::sendto(fd, buf, len, flags, to, tolen);
+  }
+  virtual ssize_t sendmsg(int fd, const struct msghdr* msg, int flags){
+    return ::sendmsg(fd, msg, flags);
+  }
+  virtual ssize_t recvfrom(int fd, void* buf, size_t len, int flags,
+                           struct sockaddr* from, socklen_t* fromlen){
+    return ::recvfrom(fd, buf, len, flags, from, fromlen);
+  }
+  virtual ssize_t recvmsg(int fd, struct msghdr* msg, int flags){
+    return ::recvmsg(fd, msg, flags);
+  }
+  virtual int poll(struct pollfd* fds, nfds_t nfds, int ms){
+    return ::poll(fds, nfds, ms);
+  }
+  virtual int setsockopt(int fd, int level, int name, const void* val, socklen_t len){
+    return ::setsockopt(fd, level, name, val, len);
+  }
+  virtual int getsockname(int fd, struct sockaddr* addr, socklen_t* len){
+    return ::getsockname(fd, addr, len);
+  }
+
+  //seconds on a clock that never steps back
+  virtual double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  //fills key with secret bits for siphash24
+  virtual void key(uint64_t key[2]){
+    siphash_key(key);
+  }
+
+  //false if disk I/O has to stay on the calling thread
+  virtual bool threads(){
+    return true;
+  }
+};
+
+inline netio*& net_slot()
+{
+  static netio sys;
+  static netio* current = &sys;
+  return current;
+}
+
+inline netio* net()
+{
+  return net_slot();
+}
+
+inline void set_net(netio* n)
+{
+  net_slot() = n;
+}
+
+#endif
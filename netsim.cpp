@@ -0,0 +1,630 @@
+/* netsim: runs the server and the client against each other over a
+ simulated network, in virtual time.
+
+ Both programs, and the sender and receiver of libtransport under them,
+ are compiled into this one, each in a namespace of its own, and run on a
+ thread each. They reach the network and the clock through
+ net() (netio.hpp), which here is a discrete-event simulator: only one of
+ them runs at any moment, and virtual time moves on only when both wait,
+ to the next datagram arrival or timeout. Loss, delay, jitter and the
+ bottleneck queue are drawn from a seeded generator, and the disk
+ pipelines run inline, so a run is a pure function of its seed: the same
+ seed always gives the same packets, timings and retransmissions.
+
+ Each run forks, so every run starts from fresh globals. With -r a run
+ is several transfers in a row through libtransport instead of the two
+ mains: one Listener serving them all, and a Connection for each, which
+ checks that the library puts back its state between transfers. */
+
+#include "tcp.hpp"
+#include "fec.hpp"
+#include "siphash.hpp"
+#include "spsc.hpp"
+#include "netio.hpp"
+#include "isn.hpp"
+#include "busypoll.hpp"
+#include "blockcache.hpp"
+#include "ecn.hpp"
+#include <iostream>
+#include <fstream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <netdb.h>
+#include <math.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sched.h>
+#include <signal.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <deque>
+#include <queue>
+#include <vector>
+
+#include "sender.cpp"
+#include "receiver.cpp"
+
+namespace server {
+#include "server.cpp"
+}
+
+namespace client {
+#include "client.cpp"
+}
+
+#define SIM_TICK 0.0001     // virtual time a poll of an empty socket takes
+#define SERVER 0
+#define CLIENT 1
+
+/* splitmix64: small, fast, and the same sequence on every platform */
+struct prng {
+    uint64_t state;
+
+    prng(uint64_t seed) : state(seed) {}
+
+    uint64_t next()
+    {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    // uniform in [0, 1)
+    double uniform()
+    {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+};
+
+struct datagram {
+    double arrival;
+    long id;        // order of sending, breaks ties
+    int tos;        // its TOS byte, ECN field included
+    std::string data;
+};
+
+struct later {
+    bool operator()(const datagram &a, const datagram &b) const
+    {
+        return a.arrival > b.arrival || (a.arrival == b.arrival && a.id > b.id);
+    }
+};
+
+// the path from one endpoint to the other
+struct link_params {
+    double loss;        // probability a datagram is dropped
+    double delay;       // one-way propagation delay, seconds
+    double jitter;      // extra delay, uniform in [0, jitter)
+    double rate;        // bottleneck bytes per second, 0 for unlimited
+    double queue;       // bytes the bottleneck queues before dropping
+    double mark;        // bytes queued past which ECN-capable datagrams are
+                        // marked CE, 0 for never
+};
+
+struct endpoint {
+    std::priority_queue<datagram, std::vector<datagram>, later> inbox;
+    struct sockaddr_in addr;
+    double wake;        // when its current wait ends without a datagram
+    double rcvtimeo;    // SO_RCVTIMEO, 0 for none
+    double linkFree;    // when the bottleneck towards the peer is idle again
+    int tos;            // IP_TOS (or IPV6_TCLASS) of what it sends
+    bool recvtos;       // IP_RECVTOS: it wants the TOS byte of what it receives
+    bool done;
+    double doneAt;
+    long sent, dropped, marked;
+};
+
+thread_local int self = -1;     // the endpoint this thread runs
+
+class simnet : public netio {
+public:
+    endpoint ep[2];
+    link_params link;
+    double limit;           // virtual seconds before a run is abandoned
+    double clock;
+    bool finished;
+    bool stuck;             // both ends waiting for nothing, or over the limit
+
+    simnet(const link_params &lp, uint64_t seed, double lim)
+        : link(lp), limit(lim), clock(0), finished(false), stuck(false),
+          running(-1), nextId(0), rng(seed)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            bzero(&ep[i].addr, sizeof(ep[i].addr));
+            ep[i].addr.sin_family = AF_INET;
+            ep[i].addr.sin_addr.s_addr = htonl(0x0a000001 + i);    // 10.0.0.1, 10.0.0.2
+            ep[i].addr.sin_port = htons(5000 + i);
+            ep[i].wake = 0;
+            ep[i].rcvtimeo = 0;
+            ep[i].linkFree = 0;
+            ep[i].tos = 0;
+            ep[i].recvtos = false;
+            ep[i].done = false;
+            ep[i].doneAt = 0;
+            ep[i].sent = ep[i].dropped = ep[i].marked = 0;
+        }
+    }
+
+    // runs entry as endpoint id, once the scheduler gets to it
+    void run(int id, int (*entry)(int, char **), std::vector<std::string> args)
+    {
+        std::vector<char *> argv;
+        for (size_t i = 0; i < args.size(); i++)
+            argv.push_back(&args[i][0]);
+        argv.push_back(NULL);
+
+        self = id;
+        std::unique_lock<std::mutex> lock(mu);
+        cv.wait(lock, [&]{ return running == self; });
+        optind = 1;
+        lock.unlock();
+        entry((int)args.size(), &argv[0]);
+        lock.lock();
+        ep[self].done = true;
+        ep[self].doneAt = clock;
+        schedule();
+    }
+
+    // lets the first endpoint go, and waits until the run is over
+    void start()
+    {
+        std::unique_lock<std::mutex> lock(mu);
+        schedule();
+        cv.wait(lock, [&]{ return finished; });
+    }
+
+    ssize_t sendto(int fd, const void *buf, size_t len, int flags,
+                   const struct sockaddr *to, socklen_t tolen)
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        endpoint &me = ep[self];
+        me.sent++;
+        if (rng.uniform() < link.loss)
+        {
+            me.dropped++;
+            return len;
+        }
+        datagram d;
+        d.tos = me.tos;
+        double t = clock;
+        if (link.rate > 0)
+        {
+            double start = me.linkFree > clock ? me.linkFree : clock;
+            double queued = (start - clock) * link.rate;
+            if (queued > link.queue)
+            {
+                me.dropped++;
+                return len;
+            }
+            if (link.mark > 0 && queued > link.mark && (d.tos & ECN_MASK) != 0)
+            {
+                d.tos |= ECN_CE;
+                me.marked++;
+            }
+            me.linkFree = start + len / link.rate;
+            t = me.linkFree;
+        }
+        d.arrival = t + link.delay + link.jitter * rng.uniform();
+        d.id = nextId++;
+        d.data.assign((const char *)buf, len);
+        ep[1 - self].inbox.push(d);
+        return len;
+    }
+
+    // no segmentation offload here: the server falls back to sendto
+    ssize_t sendmsg(int fd, const struct msghdr *msg, int flags)
+    {
+        if (msg->msg_controllen > 0)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        std::string all;
+        for (size_t i = 0; i < msg->msg_iovlen; i++)
+            all.append((const char *)msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+        return sendto(fd, all.data(), all.size(), flags, (const struct sockaddr *)msg->msg_name,
+                      msg->msg_namelen);
+    }
+
+    ssize_t recvfrom(int fd, void *buf, size_t len, int flags,
+                     struct sockaddr *from, socklen_t *fromlen)
+    {
+        std::unique_lock<std::mutex> lock(mu);
+        datagram d;
+        if (!take(lock, flags, d))
+            return -1;
+        size_t n = d.data.size() < len ? d.data.size() : len;
+        memcpy(buf, d.data.data(), n);
+        setPeer(from, fromlen);
+        return n;
+    }
+
+    ssize_t recvmsg(int fd, struct msghdr *msg, int flags)
+    {
+        std::unique_lock<std::mutex> lock(mu);
+        datagram d;
+        if (!take(lock, flags, d))
+            return -1;
+        size_t n = 0;
+        for (size_t i = 0; i < msg->msg_iovlen && n < d.data.size(); i++)
+        {
+            size_t part = d.data.size() - n;
+            if (part > msg->msg_iov[i].iov_len)
+                part = msg->msg_iov[i].iov_len;
+            memcpy(msg->msg_iov[i].iov_base, d.data.data() + n, part);
+            n += part;
+        }
+        msg->msg_flags = n < d.data.size() ? MSG_TRUNC : 0;
+        // the only control data here is the TOS byte, as IPv4 gives it
+        size_t room = msg->msg_controllen;
+        msg->msg_controllen = 0;
+        if (ep[self].recvtos && room >= CMSG_SPACE(1))
+        {
+            struct cmsghdr *cm = (struct cmsghdr *)msg->msg_control;
+            cm->cmsg_level = IPPROTO_IP;
+            cm->cmsg_type = IP_TOS;
+            cm->cmsg_len = CMSG_LEN(1);
+            *CMSG_DATA(cm) = (unsigned char)d.tos;
+            msg->msg_controllen = CMSG_SPACE(1);
+        }
+        setPeer((struct sockaddr *)msg->msg_name, &msg->msg_namelen);
+        return n;
+    }
+
+    int poll(struct pollfd *fds, nfds_t nfds, int ms)
+    {
+        std::unique_lock<std::mutex> lock(mu);
+        double until = ms < 0 ? INFINITY : clock + ms / 1000.0;
+        for (nfds_t i = 0; i < nfds; i++)
+            fds[i].revents = 0;
+        while (true)
+        {
+            if (due())
+            {
+                fds[0].revents = POLLIN;
+                return 1;
+            }
+            if (clock >= until)
+                return 0;
+            block(lock, until);
+        }
+    }
+
+    int setsockopt(int fd, int level, int name, const void *val, socklen_t len)
+    {
+        if (level == SOL_SOCKET && name == SO_RCVTIMEO)
+        {
+            const struct timeval *tv = (const struct timeval *)val;
+            ep[self].rcvtimeo = tv->tv_sec + tv->tv_usec / 1e6;
+        }
+        if ((level == IPPROTO_IP && name == IP_TOS) || (level == IPPROTO_IPV6 && name == IPV6_TCLASS))
+            ep[self].tos = *(const int *)val;
+        if ((level == IPPROTO_IP && name == IP_RECVTOS) ||
+            (level == IPPROTO_IPV6 && name == IPV6_RECVTCLASS))
+            ep[self].recvtos = *(const int *)val != 0;
+#ifdef UDP_GRO
+        if (level == IPPROTO_UDP && name == UDP_GRO)
+        {
+            errno = ENOPROTOOPT;
+            return -1;
+        }
+#endif
+        return 0;
+    }
+
+    // each endpoint is bound to its address in ep, whatever it asked for
+    int getsockname(int fd, struct sockaddr *addr, socklen_t *len)
+    {
+        socklen_t n = *len < sizeof(ep[self].addr) ? *len : sizeof(ep[self].addr);
+        memcpy(addr, &ep[self].addr, n);
+        *len = sizeof(ep[self].addr);
+        return 0;
+    }
+
+    double now()
+    {
+        return clock;
+    }
+
+    void key(uint64_t key[2])
+    {
+        std::lock_guard<std::mutex> lock(mu);
+        key[0] = rng.next();
+        key[1] = rng.next();
+    }
+
+    bool threads()
+    {
+        return false;
+    }
+
+private:
+    std::mutex mu;
+    std::condition_variable cv;
+    int running;            // the endpoint allowed to run, -1 for none
+    long nextId;
+    prng rng;
+
+    // a datagram has arrived for this thread's endpoint
+    bool due()
+    {
+        return !ep[self].inbox.empty() && ep[self].inbox.top().arrival <= clock;
+    }
+
+    /* Takes the next datagram that has arrived, waiting for one as long
+     as the socket would: a tick for MSG_DONTWAIT, so that a polling loop
+     still lets time pass, else up to SO_RCVTIMEO or for ever. */
+    bool take(std::unique_lock<std::mutex> &lock, int flags, datagram &d)
+    {
+        double until = (flags & MSG_DONTWAIT) ? clock + SIM_TICK :
+                       (ep[self].rcvtimeo > 0 ? clock + ep[self].rcvtimeo : INFINITY);
+        while (!due())
+        {
+            if (clock >= until)
+            {
+                errno = EAGAIN;
+                return false;
+            }
+            block(lock, until);
+        }
+        d = ep[self].inbox.top();
+        ep[self].inbox.pop();
+        return true;
+    }
+
+    void setPeer(struct sockaddr *from, socklen_t *fromlen)
+    {
+        if (from == NULL || fromlen == NULL)
+            return;
+        socklen_t n = *fromlen < sizeof(struct sockaddr_in) ? *fromlen : sizeof(struct sockaddr_in);
+        memcpy(from, &ep[1 - self].addr, n);
+        *fromlen = sizeof(struct sockaddr_in);
+    }
+
+    // parks this thread until its next event, running the other meanwhile
+    void block(std::unique_lock<std::mutex> &lock, double until)
+    {
+        ep[self].wake = until;
+        schedule();
+        cv.wait(lock, [&]{ return running == self; });
+    }
+
+    /* Hands the run to the endpoint with the earliest event, moving the
+     clock to it; ties go to the server. */
+    void schedule()
+    {
+        int next = -1;
+        double when = INFINITY;
+        for (int i = 0; i < 2; i++)
+        {
+            if (ep[i].done)
+                continue;
+            double t = ep[i].wake;
+            if (!ep[i].inbox.empty() && ep[i].inbox.top().arrival < t)
+                t = ep[i].inbox.top().arrival;
+            if (t < when)
+            {
+                when = t;
+                next = i;
+            }
+        }
+        if (next < 0 || when > limit)
+        {
+            stuck = (next >= 0 || !ep[SERVER].done || !ep[CLIENT].done);
+            finished = true;
+            running = -1;
+            cv.notify_all();
+            return;
+        }
+        if (when > clock)
+            clock = when;
+        running = next;
+        cv.notify_all();
+    }
+};
+
+bool sameFile(const char *a, const char *b)
+{
+    std::ifstream fa(a, std::ios::binary), fb(b, std::ios::binary);
+    if (!fa || !fb)
+        return false;
+    std::string da((std::istreambuf_iterator<char>(fa)), std::istreambuf_iterator<char>());
+    std::string db((std::istreambuf_iterator<char>(fb)), std::istreambuf_iterator<char>());
+    return da == db;
+}
+
+/* -r: the transfers of a run, and the options of both ends from the flags */
+int transfers = 1;
+transport::options serverOptions, clientOptions;
+const char *sentFile;
+long badTransfers = 0;     // transfers whose file did not arrive intact
+
+int serveInARow(int argc, char **argv)
+{
+    transport::Listener listener(0, serverOptions);
+    for (int i = 0; i < transfers; i++)
+        if (listener.serve(sentFile) != 0)
+            return 1;
+    return 0;
+}
+
+int receiveInARow(int argc, char **argv)
+{
+    for (int i = 0; i < transfers; i++)
+    {
+        int rc;
+        {
+            transport::file_sink out("received.data");
+            transport::Connection conn("127.0.0.1", "0", clientOptions);
+            rc = conn.receive(out);
+        }
+        if (rc != 0 || !sameFile(sentFile, "received.data"))
+            badTransfers++;
+    }
+    return 0;
+}
+
+/* One transfer, in a child process. Prints its result line and exits 0 if
+ the file arrived intact. */
+void simulate(const link_params &lp, uint64_t seed, double limit, const char *flags,
+              const char *filename, bool verbose)
+{
+    if (!verbose)
+    {
+        cout.setstate(std::ios::badbit);
+        cerr.setstate(std::ios::badbit);
+    }
+
+    simnet sim(lp, seed, limit);
+    set_net(&sim);
+
+    std::vector<std::string> sargs, cargs;
+    sargs.push_back("server");
+    cargs.push_back("client");
+    if (flags[0] != '\0')
+        sargs.push_back(std::string("-") + flags);
+    if (strchr(flags, 'k') != NULL)
+        cargs.push_back("-k");
+    sargs.push_back("0");
+    sargs.push_back(filename);
+    cargs.push_back("127.0.0.1");
+    cargs.push_back("0");
+
+    serverOptions.checksum = clientOptions.checksum = strchr(flags, 'k') != NULL;
+    serverOptions.compress = strchr(flags, 'z') != NULL;
+    serverOptions.fec = strchr(flags, 'f') != NULL;
+    serverOptions.ecn = strchr(flags, 'e') != NULL;
+    serverOptions.zero_rtt = strchr(flags, '0') != NULL;
+    serverOptions.log = clientOptions.log = true;     // as the binaries, silenced above unless -v
+    sentFile = filename;
+
+    bool library = transfers > 1;
+    std::thread s(&simnet::run, &sim, SERVER, library ? serveInARow : server::main, sargs);
+    std::thread c(&simnet::run, &sim, CLIENT, library ? receiveInARow : client::main, cargs);
+    s.detach();
+    c.detach();
+    sim.start();
+
+    bool ok = !sim.stuck && badTransfers == 0 && sameFile(filename, "received.data");
+    struct stat st;
+    long size = stat(filename, &st) == 0 ? (long)st.st_size * transfers : 0;
+    double secs = sim.ep[CLIENT].doneAt;
+    printf("seed %llu: %ld bytes in %.6f s (%.3f Mbit/s), %ld+%ld datagrams, %ld+%ld lost, "
+           "%ld marked, %ld retransmitted, %ld rebuilt, %s\n",
+           (unsigned long long)seed, size, secs, secs > 0 ? size * 8 / secs / 1e6 : 0.0,
+           sim.ep[SERVER].sent, sim.ep[CLIENT].sent, sim.ep[SERVER].dropped, sim.ep[CLIENT].dropped,
+           sim.ep[SERVER].marked, sender::retransmits, receiver::recovered,
+           ok ? "ok" : (sim.stuck ? "STUCK" : "CORRUPT"));
+    fflush(stdout);
+    // the endpoint threads may still be parked: leave without unwinding
+    _exit(ok ? 0 : 1);
+}
+
+int main(int argc, char **argv)
+{
+    link_params lp;
+    lp.loss = 0;
+    lp.delay = 0.01;
+    lp.jitter = 0;
+    lp.rate = 0;
+    lp.queue = 65536;
+    lp.mark = 0;
+    uint64_t seed = 1;
+    int runs = 1;
+    double limit = 600;
+    bool verbose = false;
+    std::string flags;
+    const char *usage = "Usage: ./netsim [-kzfe0v] [-l LOSS] [-d DELAY-MS] [-j JITTER-MS] "
+                        "[-b MBIT/S] [-q QUEUE-KB] [-m MARK-KB] [-s SEED] [-n RUNS] [-r TRANSFERS] "
+                        "[-t SECONDS] FILE-NAME";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "kzfe0vl:d:j:b:q:m:s:n:r:t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'k':
+            case 'z':
+            case 'f':
+            case 'e':
+            case '0':
+                flags += (char)opt;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'l':
+                lp.loss = atof(optarg);
+                break;
+            case 'd':
+                lp.delay = atof(optarg) / 1000;
+                break;
+            case 'j':
+                lp.jitter = atof(optarg) / 1000;
+                break;
+            case 'b':
+                lp.rate = atof(optarg) * 1e6 / 8;
+                break;
+            case 'q':
+                lp.queue = atof(optarg) * 1024;
+                break;
+            case 'm':
+                lp.mark = atof(optarg) * 1024;
+                break;
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'n':
+                runs = atoi(optarg);
+                break;
+            case 'r':
+                transfers = atoi(optarg);
+                break;
+            case 't':
+                limit = atof(optarg);
+                break;
+            default:
+                error(usage);
+        }
+    }
+    if (argc - optind != 1 || runs < 1 || transfers < 1)
+        error(usage);
+    const char *filename = argv[optind];
+
+    int failed = 0;
+    for (int i = 0; i < runs; i++)
+    {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0)
+            error("ERROR in fork");
+        if (pid == 0)
+            simulate(lp, seed + i, limit, flags.c_str(), filename, verbose);
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            if (!WIFEXITED(status))
+                printf("seed %llu: killed by signal %d\n", (unsigned long long)(seed + i), WTERMSIG(status));
+            failed++;
+        }
+    }
+    if (runs > 1)
+        printf("%d runs, %d failed\n", runs, failed);
+    return failed > 0 ? 1 : 0;
+}
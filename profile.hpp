@@ -0,0 +1,69 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <stdint.h>
+
+/* The sizes the protocol is built around, fixed at compile time so that
+ the per-packet arithmetic on them folds into constants. Sequence numbers
+ are SEQ_BITS wide and wrap with a mask rather than a division; half of
+ that space is the window, the most that may be in flight, and the size
+ of the server's file ring and of the client's map of what has arrived.
+ MAX_DATA is the largest payload a segment may carry once the MSS option
+ and the path MTU probes have raised the segment size that far; within
+ it, the size is still settled per connection at run time. INIT_RTO_MS is
+ the retransmission timeout until a round trip has been measured.
+
+ The profile is fixed when the protocol is compiled, not configured: one
+ build, and so one process, has one. tcp.hpp picks it, the default unless
+ TRANSPORT_PROFILE names another, and calls it proto. Both ends must have
+ the same sequence number width. The SYN says how many bits the client
+ counts in, and a server that counts in others answers with a RST, on
+ which the client gives up at once. */
+
+template <unsigned SEQ_BITS, int MAX_DATA, int INIT_RTO_MS>
+struct profile {
+  static constexpr unsigned seq_bits = SEQ_BITS;
+  static constexpr long seq_space = 1L << SEQ_BITS;
+  static constexpr long seq_mask = seq_space - 1;
+  static constexpr int window = (int)(seq_space / 2);
+  static constexpr int max_data = MAX_DATA;
+  static constexpr int max_mss = MAX_DATA + HEADERSIZE;
+  static constexpr int init_window = DATASIZE;
+  static constexpr int ssthresh = window;
+  static constexpr double init_rto = INIT_RTO_MS / 1000.0;
+
+  static_assert(SEQ_BITS <= 16, "sequence numbers are 16 bits on the wire");
+  static_assert(window % 64 == 0, "the receiver maps the window 64 bytes a word");
+  static_assert(MAX_DATA >= DATASIZE && 2 * MAX_DATA <= window,
+                "the window must hold two of the largest segments");
+
+  //x mod the sequence space, for x of either sign
+  static uint16_t seq(long x){ return (uint16_t)(x & seq_mask); }
+
+  //x mod the window, where the rings of the window wrap
+  static int ring(long x){ return (int)(x & (window - 1)); }
+};
+
+template <unsigned B, int D, int R> constexpr unsigned profile<B, D, R>::seq_bits;
+template <unsigned B, int D, int R> constexpr long profile<B, D, R>::seq_space;
+template <unsigned B, int D, int R> constexpr long profile<B, D, R>::seq_mask;
+template <unsigned B, int D, int R> constexpr int profile<B, D, R>::window;
+template <unsigned B, int D, int R> constexpr int profile<B, D, R>::max_data;
+template <unsigned B, int D, int R> constexpr int profile<B, D, R>::max_mss;
+template <unsigned B, int D, int R> constexpr int profile<B, D, R>::init_window;
+template <unsigned B, int D, int R> constexpr int profile<B, D, R>::ssthresh;
+template <unsigned B, int D, int R> constexpr double profile<B, D, R>::init_rto;
+
+//./server and ./client: a 16 KB window, segments of up to 7680 bytes
+typedef profile<15, 7680, 500> default_profile;
+
+//a LAN with 9000-byte frames: a segment fills one, with room for the
+//IPv6 and UDP headers and the checksum extension, a 32 KB window, and a
+//first timeout suited to sub-millisecond round trips
+typedef profile<16, 8940, 100> lan_jumbo;
+
+//the Internet: segments that fit a 1500-byte MTU unfragmented, a 32 KB
+//window for long round trips, and the 1 s first timeout of RFC 6298
+typedef profile<16, 1440, 1000> wan;
+
+#endif
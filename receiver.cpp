@@ -0,0 +1,1168 @@
+#include "tcp.hpp"
+#include "fec.hpp"
+#include "spsc.hpp"
+#include "netio.hpp"
+#include "isn.hpp"
+#include "addr.hpp"
+#include "busypoll.hpp"
+#include "ecn.hpp"
+#include <iostream>
+#include <fstream>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <netdb.h>
+#include <math.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "transport.hpp"
+using namespace std;
+
+namespace receiver {
+
+#define RCVBUFSIZE proto::window   // the largest window the server can use
+
+uint16_t INIT_SEQ_NUM = 0;     // from isn(), for the address the handshake settles on
+const uint16_t INIT_ACK_NUM = 0;
+// one bit per byte of the window, at its stream offset mod RCVBUFSIZE:
+// received but not yet in order
+uint64_t rwnd_map[RCVBUFSIZE / 64];
+double timeout = proto::init_rto;
+double rtt_estimate = proto::init_rto;  // handshake round trip
+double finTimeout = proto::init_rto;    // wait for the ACK of our FIN: a few handshake round trips
+#define FIN_TRIES 3         // FIN-ACKs sent before closing without the last ACK
+bool checksum = false;  // attach a CRC32C to every segment sent
+uint32_t file_crc = 0;  // CRC32C of the bytes handed to the sink so far
+long badSegments = 0;
+bool fec = false;       // the server sends XOR repair segments
+fec_decoder fec_dec;
+long recovered = 0;
+int spinUs = 0;         // busy-poll this long before a blocking read, 0 for none
+vector<int> cpus;       // cores for the receive loop and the writer, if pinned
+latency_log dataLatency;
+bool logging = true;    // every packet to stdout, what a transfer came to on stderr
+
+inline ostream& trace() { return logTo(cout, logging); }
+inline ostream& stats() { return logTo(cerr, logging); }
+bool ceEcho = false;    // a segment came marked CE, and no CWR since: set RSV_ECE
+long ceMarks = 0;
+
+/* Flow control. Segments are reassembled in place in a pool of CHUNKS
+ chunks of CHUNKSIZE bytes, stream offset o living in chunk
+ o / CHUNKSIZE % CHUNKS, and in-order data leaves them as spans that point
+ into the chunks: a delivery thread hands each span to the span_sink, which
+ releases it when it is done with it, then or later. Nothing is copied
+ after the datagram itself, so the receive loop never waits on the
+ application or the disk (unless net() allows no threads, in which case
+ the loop hands each span to the sink itself). A span is handed over when
+ its chunk fills or when the socket runs dry. Once the receiver is past a
+ chunk and all its spans are released, the chunk takes the block CHUNKS
+ further on. The window advertised is what the chunks can still take
+ beyond the next expected byte, capped by rwnd_cap. The cap starts small
+ and grows with the rate the sink takes data at, to two round trips'
+ worth of data. A span of length 0 tells the delivery thread the stream is
+ complete. */
+#define CHUNKSIZE 16384
+#define CHUNKS 8
+#define SPANS 64                    // spans handed over and not yet taken
+#define RWND_MIN (4 * DATASIZE)     // window advertised before any measurement
+struct chunk {
+    std::atomic<int> refs;  // spans not released, +1 until the receiver is past it
+    unsigned char data[CHUNKSIZE];
+};
+chunk chunks[CHUNKS];
+long reusable = 0;      // first block whose chunk is not back for reuse yet
+long delivered = 0;     // stream offset of the next byte expected
+long handed = 0;        // stream offset of the first byte not handed over
+spsc_ring<transport::span, SPANS> span_ring;
+bool writerThreaded = true;
+transport::span_sink* out = NULL;   // where the delivery thread puts the data
+bool refused = false;   // the sink gave up, its spans are released unseen
+long refusedAt = 0;     // stream offset of the first span it did not take
+int rwnd_cap = RWND_MIN;
+int last_adv = RWND_MIN;    // window in the latest ACK sent
+int reopenFd = -1;      // eventfd a release signals on freeing a chunk, while
+std::atomic<bool> windowShut(false);    // the receive loop waits on a shut window
+std::atomic<double> drain_rate(0);  // bytes per second the sink takes, moving average
+
+// (re)initialize receive window and the chunks
+void initialize_rwnd() {
+    memset(rwnd_map, 0, sizeof(rwnd_map));
+    for (int i = 0; i < CHUNKS; i++)
+        chunks[i].refs.store(1, std::memory_order_relaxed);
+    reusable = delivered = handed = 0;
+    refused = false;
+    refusedAt = 0;
+}
+
+
+// sets (set = true) or clears len bits of the map from buffer position pos
+void mark_rwnd(int pos, int len, bool set) {
+    while (len > 0) {
+        int b = pos % 64;
+        int n = 64 - b < len ? 64 - b : len;
+        uint64_t mask = (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << b;
+        uint64_t &word = rwnd_map[pos / 64];
+        if (set)
+            word |= mask;
+        else
+            word &= ~mask;
+        pos = proto::ring(pos + n);
+        len -= n;
+    }
+}
+
+
+// @returns the stream offset the chunks hold data up to, having taken
+// back those the receiver is past and the sink has released
+long bufferEnd() {
+    while (reusable < handed / CHUNKSIZE &&
+           chunks[reusable % CHUNKS].refs.load(std::memory_order_acquire) == 0) {
+        chunks[reusable % CHUNKS].refs.store(1, std::memory_order_relaxed);
+        reusable++;
+    }
+    return (reusable + CHUNKS) * CHUNKSIZE;
+}
+
+
+// @returns the reveive window size at this moment, in bytes
+int rwnd_size() {
+    // bytes held out of order lie inside the window, so the chunks can
+    // always take everything from the next expected byte to bufferEnd()
+    long free = bufferEnd() - delivered;
+    if (free > RCVBUFSIZE)
+        free = RCVBUFSIZE;
+    return free < rwnd_cap ? (int)free : rwnd_cap;
+}
+
+
+// @returns the number of consecutive bytes received from buffer position pos
+// called when the receive seq = expect seq
+int consecutive_acked(int pos) {
+    int result = 0;
+    while (result < RCVBUFSIZE) {
+        int b = pos % 64;
+        uint64_t missing = ~rwnd_map[pos / 64] >> b;
+        if (missing != 0) {
+            result += __builtin_ctzll(missing);
+            break;
+        }
+        result += 64 - b;
+        pos = proto::ring(pos + 64 - b);
+    }
+    return result < RCVBUFSIZE ? result : RCVBUFSIZE;
+}
+
+
+// copies len bytes of the stream at offset off into their chunks
+void store(long off, const unsigned char* data, int len) {
+    while (len > 0) {
+        int pos = (int)(off % CHUNKSIZE);
+        int n = CHUNKSIZE - pos < len ? CHUNKSIZE - pos : len;
+        memcpy(chunks[off / CHUNKSIZE % CHUNKS].data + pos, data, n);
+        off += n;
+        data += n;
+        len -= n;
+    }
+}
+
+
+// seconds on a clock that never steps back, virtual under the simulator
+double monotonicNow() {
+    return net()->now();
+}
+
+
+// hands span s to the sink, folding it into the file digest once the
+// sink has taken it, and measures how fast the sink takes data
+// @returns false for the empty span that ends the stream
+bool takeSpan(const transport::span& s) {
+    if (s.len == 0)
+        return false;
+    if (refused) {
+        s.release();
+        return true;
+    }
+    // the sink may release s, and its data with it, before take() returns
+    uint32_t crc = crc32c(file_crc, s.data, s.len);
+    double t0 = monotonicNow();
+    if (!out->take(s)) {
+        refused = true;
+        refusedAt = s.offset;
+        s.release();
+        return true;
+    }
+    file_crc = crc;
+    double secs = monotonicNow() - t0;
+    double rate = s.len / (secs > 1e-6 ? secs : 1e-6);
+    double avg = drain_rate.load(std::memory_order_relaxed);
+    drain_rate.store(avg == 0 ? rate : 0.875 * avg + 0.125 * rate, std::memory_order_relaxed);
+    return true;
+}
+
+
+// the delivery thread: hands spans to the sink until the empty one
+void writerThread() {
+    if (!cpus.empty())
+        pin_thread(cpus.back());
+    while (true) {
+        transport::span* s = span_ring.wait_front();
+        if (!takeSpan(*s))
+            return;
+        span_ring.pop();
+    }
+}
+
+
+// without a delivery thread: hands over whatever the ring holds right here
+void writeInline() {
+    transport::span* s;
+    while ((s = span_ring.front()) != NULL) {
+        takeSpan(*s);
+        span_ring.pop();
+    }
+}
+
+
+// puts the stream from handed up to end, which lies in handed's chunk,
+// on the ring as one span; end == handed for the empty span
+void handOver(long end) {
+    transport::span* s = span_ring.wait_back();
+    int c = (int)(handed / CHUNKSIZE % CHUNKS);
+    s->data = chunks[c].data + handed % CHUNKSIZE;
+    s->len = end - handed;
+    s->offset = handed;
+    s->chunk = c;
+    // the span that ends a chunk takes over the receiver's reference
+    if (s->len > 0 && end % CHUNKSIZE != 0)
+        chunks[c].refs.fetch_add(1, std::memory_order_relaxed);
+    span_ring.push();
+    handed = end;
+    if (!writerThreaded)
+        writeInline();
+}
+
+
+// hands the in-order data not handed over yet to the sink, and lets the
+// window cap follow the rate the sink takes it at
+void flushWriter() {
+    if (delivered > handed)
+        handOver(delivered);
+    double want = 2 * drain_rate.load(std::memory_order_relaxed) * rtt_estimate;
+    if (want > rwnd_cap)
+        rwnd_cap = want > RCVBUFSIZE ? RCVBUFSIZE : (int)want;
+}
+
+
+// moves the next expected byte len bytes on, handing over each chunk
+// that this fills
+void deliver(int len) {
+    delivered += len;
+    long next;
+    while ((next = (handed / CHUNKSIZE + 1) * CHUNKSIZE) <= delivered)
+        handOver(next);
+}
+
+
+// @returns the offset of seq in the stream, given that next_seq is at next_off
+long streamOffset(uint16_t seq, uint16_t next_seq, long next_off) {
+    int diff = proto::seq(seq - next_seq);
+    if (diff < proto::window)
+        return next_off + diff;
+    return next_off - (proto::seq_space - diff);
+}
+
+
+/* UDP generic receive offload: with UDP_GRO set the kernel may hand over
+ several datagrams from the server glued together, all of the size given
+ in the control message but the last. recvSegment splits them again and
+ returns one segment per call. Without GRO support every read is a
+ single segment. */
+unsigned char gro_buf[65536];
+int gro_len = 0;        // bytes in gro_buf
+int gro_pos = 0;        // start of the next segment to return
+int gro_size = 0;       // size of the segments in gro_buf
+double gro_arrival = 0; // when gro_buf arrived, by the kernel's stamp
+int gro_ecn = 0;        // the ECN field it came with, all segments alike
+long groReads = 0, groSegments = 0;
+
+/* @returns the next segment from the server and its size in n, NULL on
+ error, or with wait = false, if there is none right now */
+unsigned char* recvSegment(int sockfd, int &n, struct sockaddr_storage &from, socklen_t &fromlen, bool wait) {
+    if (gro_pos >= gro_len) {
+        struct iovec iov;
+        iov.iov_base = gro_buf;
+        iov.iov_len = sizeof(gro_buf);
+        char control[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct timespec)) +
+                     CMSG_SPACE(sizeof(int))];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &from;
+        msg.msg_namelen = fromlen;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        
+        if (wait && spinUs > 0) {
+            // busy-poll before the blocking read, which may then not block
+            struct pollfd pfd;
+            pfd.fd = sockfd;
+            pfd.events = POLLIN;
+            if (spin_wait(&pfd, 1, spinUs) > 0)
+                wait = false;
+        }
+        int len = net()->recvmsg(sockfd, &msg, wait ? 0 : MSG_DONTWAIT);
+        if (len < 0)
+            return NULL;
+        fromlen = msg.msg_namelen;
+        gro_arrival = arrival_of(msg);
+        gro_ecn = ecn_of(msg);
+        gro_len = len;
+        gro_pos = 0;
+        gro_size = len;
+#ifdef UDP_GRO
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                int size;
+                memcpy(&size, CMSG_DATA(cm), sizeof(size));
+                if (size > 0 && size < len) {
+                    gro_size = size;
+                    groReads++;
+                    groSegments += (len + size - 1) / size;
+                }
+            }
+        }
+#endif
+    }
+    unsigned char* seg = gro_buf + gro_pos;
+    n = gro_len - gro_pos < gro_size ? gro_len - gro_pos : gro_size;
+    gro_pos += gro_size;
+    return seg;
+}
+
+
+uint16_t add(uint16_t ack, uint16_t inc) {
+    return proto::seq(ack + inc);
+}
+
+
+// echoes a path MTU probe, telling the server its size got through
+int replyToProbe(int sockfd, const struct sockaddr_storage& server, int size) {
+    segment reply;
+    reply.setFlagack();
+    reply.setFlagprobe();
+    reply.setSeqnum(size);
+    reply.setRcvwin(rwnd_size());
+    if (checksum)
+        reply.setFlagcsum();
+    unsigned char* send_buf = reply.encode(NULL, 0);
+    return net()->sendto(sockfd, send_buf, reply.getLength(), 0,
+                  (struct sockaddr *)&server, addr_len(server));
+}
+
+
+// acknowledges everything before ack_num, which is in an odd lap if lap is set
+int replyWithAck(int sockfd, const struct sockaddr_storage& server, int ack_num, bool lap, bool retrans) {
+    segment* reply = new segment();
+    reply->setFlagack();
+    reply->setAcknum(ack_num);
+    if (lap)
+        reply->setFlaglap();
+    last_adv = rwnd_size();
+    reply->setRcvwin(last_adv);
+    if (ceEcho)
+        reply->setFlagece();
+    if (checksum)
+        reply->setFlagcsum();
+    unsigned char* send_buf = reply->encode(NULL, 0);
+    int n = net()->sendto(sockfd, send_buf, reply->getLength(), 0,
+                   (struct sockaddr *)&server, addr_len(server));
+    delete reply;
+    if (retrans == false)
+        trace() << "Sending packet " << ack_num << endl;
+    else
+        trace() << "Sending packet " << ack_num << " Retransmission" << endl;
+    return n;
+}
+
+// acknowledges the server's FIN and sends ours along: FIN-ACK
+int replyWithFin(int sockfd, const struct sockaddr_storage& server, int ack_num, bool retrans) {
+    segment* reply = new segment();
+    reply->setSeqnum(add(INIT_SEQ_NUM, 1));
+    reply->setFlagack();
+    reply->setFlagfin();
+    reply->setAcknum(ack_num);
+    reply->setRcvwin(rwnd_size());
+    if (checksum)
+        reply->setFlagcsum();
+    unsigned char* send_buf = reply->encode(NULL, 0);
+    int n = net()->sendto(sockfd, send_buf, reply->getLength(), 0,
+                   (struct sockaddr *)&server, addr_len(server));
+    if(retrans == false){
+        trace() << "Sending packet " << reply->getAcknum() << " FIN"<< endl;
+    }
+    else{
+        trace() << "Sending packet " << reply->getAcknum() << " FIN Retransmission" << endl;
+    }
+    delete reply;
+    return n;
+}
+
+
+
+// explains why we give up on a server that answered our SYN with a RST:
+// it was built for another profile, whose sizes the RST carries
+void wrongProfile(segment& rst) {
+    uint16_t bits = 0, mss = 0;
+    getOption16(rst.getData(), rst.getDataLen(), OPT_SEQBITS, bits);
+    getOption16(rst.getData(), rst.getDataLen(), OPT_MSS, mss);
+    cerr << "The server counts sequence numbers in " << bits << " bits and takes segments of "
+         << mss << " bytes; this client counts in " << proto::seq_bits << " and takes "
+         << proto::max_data << endl;
+    cerr << "ERROR connection refused: the server was built for another profile" << endl;
+}
+
+
+// the handshake ACK, kept to repeat it while the server is silent
+unsigned char handshake_ack_buf[HEADERSIZE + HEADEREXTSIZE + SYN_OPTSIZE];
+int handshake_ack_len = 0;
+bool earlyFin = false;  // the SYN-ACK brought the whole file, and the FIN
+
+
+/* Happy Eyeballs (RFC 8305): the server's name may resolve to several
+ addresses, of both families, not all of which need answer. The client
+ tries them in turn, alternating IPv6 and IPv4 after the resolver's first
+ choice, each from a socket of its own: a SYN goes to the next address
+ every ATTEMPT_DELAY, or at once when a send fails, and each SYN is
+ repeated every timeout until answered. The first SYN-ACK decides the
+ connection, and the other attempts are dropped. */
+#define ATTEMPT_DELAY 0.25  // RFC 8305's Connection Attempt Delay, seconds
+
+struct attempt {
+    int fd;
+    struct sockaddr_storage addr;
+    uint16_t isn;       // our initial sequence number on this four-tuple
+    double sent;        // when its SYN last went out
+    bool retried;       // the SYN went out more than once
+    bool failed;        // no socket, or a send failed
+};
+
+
+/* @returns the server's addresses from getaddrinfo, families alternating,
+ each with a socket bound to an ephemeral port and the initial sequence
+ number for the four-tuple that makes; none if the name does not resolve */
+vector<attempt> resolve(const char* host, const char* port) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    struct addrinfo* res;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        cerr << "ERROR resolving " << host << ": " << gai_strerror(err) << endl;
+        return vector<attempt>();
+    }
+    
+    // the resolver's order within each family, the first result's family first
+    vector<attempt> first, other, all;
+    for (struct addrinfo* ai = res; ai != NULL; ai = ai->ai_next) {
+        attempt a;
+        memset(&a, 0, sizeof(a));
+        memcpy(&a.addr, ai->ai_addr, ai->ai_addrlen);
+        (ai->ai_family == res->ai_family ? first : other).push_back(a);
+    }
+    freeaddrinfo(res);
+    for (size_t i = 0; i < first.size() || i < other.size(); i++) {
+        if (i < first.size())
+            all.push_back(first[i]);
+        if (i < other.size())
+            all.push_back(other[i]);
+    }
+    
+    for (size_t i = 0; i < all.size(); i++) {
+        attempt& a = all[i];
+        // bound now, rather than at the first send, so the four-tuple is complete
+        struct sockaddr_storage local;
+        memset(&local, 0, sizeof(local));
+        local.ss_family = a.addr.ss_family;
+        socklen_t locallen = addr_len(local);
+        a.fd = socket(a.addr.ss_family, SOCK_DGRAM, 0);
+        if (a.fd < 0 || ::bind(a.fd, (struct sockaddr *)&local, locallen) == -1 ||
+            net()->getsockname(a.fd, (struct sockaddr *)&local, &locallen) == -1) {
+            a.failed = true;
+            continue;
+        }
+        a.isn = isn(local, a.addr, proto::seq_space);
+    }
+    return all;
+}
+
+
+// the SYN for a, which asks for our options
+segment synFor(const attempt& a) {
+    segment syn;
+    syn.setSeqnum(a.isn);
+    syn.setAcknum(INIT_ACK_NUM);
+    syn.setRcvwin(rwnd_size());
+    syn.setFlagsyn();
+    if (checksum)
+        syn.setFlagcsum();    // asks the server for checksums
+    syn.setFlagcomp();        // we can decompress segments
+    syn.setFlagfec();         // and rebuild them from repair segments
+    syn.setFlagece();         // and echo ECN marks
+    syn.setFlagcwr();
+    return syn;
+}
+
+
+/*  Races the attempts until one gets a SYN-ACK acknowledging its initial
+ sequence number; that attempt's socket and address become sockfd and
+ server, the others are closed. Returns the server's initial sequence
+ number, or -1 with every socket closed if no attempt got through or the
+ server refused us. Data carried by the SYN-ACK is copied to early, its
+ length to early_len. */
+int handshake(vector<attempt>& attempts, int& sockfd, struct sockaddr_storage& server,
+                   unsigned char* early, int& early_len) {
+    
+    unsigned char recv_buf[proto::max_mss + HEADEREXTSIZE];
+    bzero(recv_buf, sizeof(recv_buf));
+    
+    // tell the server how large a segment we can take, and how wide
+    // our sequence numbers are
+    unsigned char options[SYN_OPTSIZE];
+    int optlen = putOption16(options, 0, OPT_MSS, proto::max_data);
+    optlen = putOption16(options, optlen, OPT_SEQBITS, proto::seq_bits);
+    // padded, since a server sends early data only to a SYN of a
+    // third its size, lest a forged one turn it into an amplifier
+    unsigned char padded[SYN_PADDING];
+    bzero(padded, sizeof(padded));
+    memcpy(padded, options, optlen);
+    unsigned char* send_buf;
+    
+    size_t started = 0;     // attempts whose SYN went out
+    double lastStart = 0;
+    int won = -1;
+    int recv_len = 0;
+    bool gaveUp = false;    // no attempt left, or the server refused us
+    while (won < 0 && !gaveUp) {
+        double now = monotonicNow();
+        bool live = false;
+        for (size_t i = 0; i < started; i++)
+            live = live || !attempts[i].failed;
+        
+        // the next address, when its turn comes or nothing else is left
+        if (started < attempts.size() && (started == 0 || !live || now >= lastStart + ATTEMPT_DELAY)) {
+            attempt& a = attempts[started++];
+            lastStart = now;
+            if (a.failed)
+                continue;
+            segment syn = synFor(a);
+            send_buf = syn.encode(padded, sizeof(padded));
+            if (net()->sendto(a.fd, send_buf, syn.getLength(), 0,
+                              (struct sockaddr *)&a.addr, addr_len(a.addr)) < 0) {
+                a.failed = true;
+                continue;
+            }
+            a.sent = now;
+            trace() << "Sending packet SYN\n";
+            continue;
+        }
+        if (!live) {
+            cerr << "ERROR in send: handshake" << endl;
+            gaveUp = true;
+            continue;
+        }
+        
+        // repeat the SYNs that went unanswered; due is when now >= the time
+        // wake is set to, the same sum, or rounding can leave a wait of 0
+        double wake = started < attempts.size() ? lastStart + ATTEMPT_DELAY : now + timeout;
+        for (size_t i = 0; i < started; i++) {
+            attempt& a = attempts[i];
+            if (a.failed)
+                continue;
+            if (now >= a.sent + timeout) {
+                segment syn = synFor(a);
+                send_buf = syn.encode(padded, sizeof(padded));
+                if (net()->sendto(a.fd, send_buf, syn.getLength(), 0,
+                                  (struct sockaddr *)&a.addr, addr_len(a.addr)) < 0) {
+                    a.failed = true;
+                    continue;
+                }
+                trace() << "Sending packet Retransmission SYN \n";
+                a.retried = true;
+                a.sent = now;
+            }
+            if (a.sent + timeout < wake)
+                wake = a.sent + timeout;
+        }
+        
+        // wait for a SYN-ACK on any of them
+        vector<struct pollfd> pfds;
+        vector<int> which;
+        for (size_t i = 0; i < started; i++) {
+            if (attempts[i].failed)
+                continue;
+            struct pollfd p;
+            p.fd = attempts[i].fd;
+            p.events = POLLIN;
+            p.revents = 0;
+            pfds.push_back(p);
+            which.push_back((int)i);
+        }
+        int wait_ms = wake > now ? (int)((wake - now) * 1000) + 1 : 0;
+        if (pfds.empty() || net()->poll(&pfds[0], pfds.size(), wait_ms) <= 0)
+            continue;
+        for (size_t j = 0; j < pfds.size() && won < 0; j++) {
+            if (!(pfds[j].revents & POLLIN))
+                continue;
+            attempt& a = attempts[which[j]];
+            struct sockaddr_storage from;
+            socklen_t fromlen = sizeof(from);
+            recv_len = net()->recvfrom(a.fd, recv_buf, sizeof(recv_buf), MSG_DONTWAIT,
+                                       (struct sockaddr *)&from, &fromlen);
+            if (recv_len < 8)
+                continue;
+            segment r;
+            if (!r.decode(recv_buf, recv_len)) {
+                badSegments++;
+                continue;
+            }
+            trace() << "received seq num: " << r.getSeqnum() << endl;
+            if (r.getFlagack() && r.getFlagrst() && r.getAcknum() == a.isn) {
+                wrongProfile(r);
+                gaveUp = true;
+                break;
+            }
+            if (r.getFlagack() && r.getFlagsyn() && r.getAcknum() == add(a.isn, 1))
+                won = which[j];
+        }
+    }
+    if (gaveUp) {
+        for (size_t i = 0; i < attempts.size(); i++)
+            if (attempts[i].fd >= 0)
+                close(attempts[i].fd);
+        return -1;
+    }
+    
+    attempt& a = attempts[won];
+    // no retransmission, so this was one round trip
+    if (!a.retried) {
+        double elapsed = monotonicNow() - a.sent;
+        // no less than a millisecond, however close the server
+        rtt_estimate = elapsed > 0.001 ? elapsed : 0.001;
+        finTimeout = 4 * elapsed;
+        finTimeout = finTimeout < 0.01 ? 0.01 : (finTimeout > timeout ? timeout : finTimeout);
+    }
+    for (size_t i = 0; i < attempts.size(); i++) {
+        if ((int)i != won && attempts[i].fd >= 0)
+            close(attempts[i].fd);
+    }
+    sockfd = a.fd;
+    server = a.addr;
+    INIT_SEQ_NUM = a.isn;
+    socklen_t serverlen = addr_len(server);
+    
+    segment response;
+    response.decode(recv_buf, recv_len);
+    
+    // the server may turn checksums on even if we did not ask
+    if (response.getFlagcsum())
+        checksum = true;
+    fec = response.getFlagfec();
+    
+    // the start of the file may come with the SYN-ACK
+    early_len = response.getDataLen();
+    if (early_len > DATASIZE)
+        early_len = DATASIZE;
+    memcpy(early, response.getData(), early_len);
+    // and when that is the whole of it, the FIN: our ACK is then the FIN-ACK
+    earlyFin = response.getFlagfin();
+    int fin = earlyFin ? 1 : 0;
+    
+    // the server kept no state for our SYN: repeat its options, and our
+    // sequence number, so it can check its cookie and set up from this
+    segment handshake_ack;
+    
+    handshake_ack.setFlagack();
+    if (earlyFin)
+        handshake_ack.setFlagfin();
+    handshake_ack.setSeqnum(add(INIT_SEQ_NUM, 1));
+    handshake_ack.setRcvwin(rwnd_size());
+    setReplyAck(response, handshake_ack, 1 + early_len + fin);
+    if (lapOf(add(response.getSeqnum(), 1), early_len + fin))
+        handshake_ack.setFlaglap();
+    if (checksum)
+        handshake_ack.setFlagcsum();
+    handshake_ack.setFlagcomp();
+    handshake_ack.setFlagfec();
+    handshake_ack.setFlagece();
+    handshake_ack.setFlagcwr();
+    send_buf = handshake_ack.encode(options, optlen);
+    handshake_ack_len = handshake_ack.getLength();
+    memcpy(handshake_ack_buf, send_buf, handshake_ack_len);
+    
+    int n = net()->sendto(sockfd, send_buf, handshake_ack.getLength(), 0,
+               (struct sockaddr *)&server, serverlen);
+    if (n < 0) {
+        cerr << "ERROR in send: handshake" << endl;
+        close(sockfd);
+        sockfd = -1;
+        return -1;
+    }
+    
+    trace() << "Sending packet " << handshake_ack.getAcknum() << (earlyFin ? " FIN" : "") << endl;
+    
+    return response.getSeqnum();
+}
+
+
+
+/* The connection, from the handshake on: the socket that won the race,
+ the server's address, and the data that came with its SYN-ACK. */
+int sockfd = -1;
+struct sockaddr_storage serveraddr;
+socklen_t serverlen;
+uint16_t InitSeq;
+unsigned char early[DATASIZE];
+int early_len = 0;
+
+/* Puts back the state a connection leaves behind, so that a process can
+ make one after another. The options are set again by the Connection. */
+void newConnection() {
+    INIT_SEQ_NUM = 0;
+    timeout = rtt_estimate = finTimeout = proto::init_rto;
+    file_crc = 0;
+    badSegments = recovered = ceMarks = 0;
+    fec = false;
+    fec_dec.reset();
+    dataLatency = latency_log();
+    ceEcho = false;
+    // the empty span that ended the last stream is still queued
+    while (span_ring.front() != NULL)
+        span_ring.pop();
+    rwnd_cap = last_adv = RWND_MIN;
+    drain_rate.store(0, std::memory_order_relaxed);
+    gro_len = gro_pos = gro_size = gro_ecn = 0;
+    gro_arrival = 0;
+    groReads = groSegments = 0;
+    handshake_ack_len = 0;
+    earlyFin = false;
+    early_len = 0;
+}
+
+/* Connects to port at hostname: every address of it, raced.
+ @returns 0, or -1 if the name did not resolve or no address took us */
+int connectServer(const char *hostname, const char *port) {
+    newConnection();
+    
+    /* getaddrinfo: every address of the server, a socket for each */
+    vector<attempt> attempts = resolve(hostname, port);
+    if (attempts.empty())
+        return -1;
+    
+    // if no address answers, client will hang
+    int isn = handshake(attempts, sockfd, serveraddr, early, early_len);
+    if (isn < 0)
+        return -1;
+    InitSeq = isn;
+    serverlen = addr_len(serveraddr);
+    
+    // wake up now and then, to repeat the handshake ACK if it got lost
+    struct timeval rcv_timeout;
+    rcv_timeout.tv_sec = 0;
+    rcv_timeout.tv_usec = (long)(timeout * 1000000);
+    net()->setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &rcv_timeout, sizeof(rcv_timeout));
+    
+    // stamp arrivals, for the latency report; busy-poll if asked to
+    int on = 1;
+    net()->setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+    if (spinUs > 0 && busy_poll_socket(sockfd, spinUs) == -1)
+        perror("SO_BUSY_POLL");
+    
+    // read the ECN field of the server's datagrams, to echo CE marks
+    if (recv_ecn(sockfd) == -1)
+        perror("IP_RECVTOS");
+    
+#ifdef UDP_GRO
+    // let the kernel coalesce the data segments, recvSegment splits them
+    int optval = 1;
+    net()->setsockopt(sockfd, IPPROTO_UDP, UDP_GRO, &optval, sizeof(optval));
+#endif
+    return 0;
+}
+
+/* Waits for the server, having advertised a shut window: for a datagram,
+ or for the sink to free a chunk, which the server would otherwise only
+ hear of from its persist probe. @returns true if a datagram is waiting */
+bool awaitServer() {
+    windowShut.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (rwnd_size() >= DATASIZE) {  // freed since we last looked
+        windowShut.store(false, std::memory_order_relaxed);
+        return false;
+    }
+    struct pollfd pfd[2];
+    pfd[0].fd = sockfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = reopenFd;
+    pfd[1].events = POLLIN;
+    pfd[0].revents = pfd[1].revents = 0;
+    net()->poll(pfd, 2, (int)(timeout * 1000) + 1);
+    windowShut.store(false, std::memory_order_relaxed);
+    eventfd_t freed;
+    if (pfd[1].revents & POLLIN)
+        eventfd_read(reopenFd, &freed);
+    return pfd[0].revents != 0;
+}
+
+/* Receives the file from the server connectServer() reached, as spans
+ handed to sink. @returns 0, 1 if the file digest did not match, 2 if
+ the sink refused some of it, or 3 if the socket failed before the end */
+int receiveInto(transport::span_sink &sink) {
+    int n;
+    initialize_rwnd();
+    bool digest_ok = true;
+    
+    out = &sink;
+    std::thread writer;
+    writerThreaded = net()->threads();
+    if (writerThreaded && (reopenFd = eventfd(0, EFD_NONBLOCK)) == -1)
+        perror("eventfd");
+    if (writerThreaded)
+        writer = std::thread(writerThread);
+    store(0, early, early_len);
+    deliver(early_len);
+    
+    uint16_t seq_base = add(InitSeq, 1);    // sequence number of the first byte of the file
+    uint16_t NextExpSeq = add(InitSeq, 1 + early_len);  // update next expected sequence number
+    // delivered: stream offset of NextExpSeq
+    bool heard = false;     // anything from the server since the handshake
+    long fin_offset = earlyFin ? delivered : -1;  // stream offset of the server's FIN, once seen
+    bool has_digest = false;
+    uint32_t expected_crc = 0;
+    bool lost = false;      // the socket failed, and the rest of the stream with it
+    
+    
+    double arrival = 0;     // of the segment in hand, by the kernel's stamp
+    while(delivered != fin_offset) {
+        dataLatency.add(arrival);
+        arrival = 0;
+        
+        /* get the server's reply */
+        unsigned char* seg_buf = recvSegment(sockfd, n, serveraddr, serverlen, false);
+        if (seg_buf == NULL && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // the socket ran dry: a good moment to hand over what we have,
+            // and to tell the server if that reopened a closed window
+            flushWriter();
+            if (heard && last_adv < DATASIZE && rwnd_size() >= DATASIZE)
+                replyWithAck(sockfd, serveraddr, NextExpSeq, lapOf(seq_base, delivered), true);
+            else if (heard && last_adv < DATASIZE && reopenFd >= 0 && !awaitServer())
+                continue;
+            seg_buf = recvSegment(sockfd, n, serveraddr, serverlen, true);
+        }
+        if (seg_buf == NULL) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("recvfrom");
+                lost = true;
+                break;
+            }
+            // the server only starts once our handshake ACK arrives
+            if (!heard)
+                net()->sendto(sockfd, handshake_ack_buf, handshake_ack_len, 0,
+                       (struct sockaddr *)&serveraddr, serverlen);
+            continue;
+        }
+        heard = true;
+        arrival = gro_arrival;
+        if (n < 8 || n > proto::max_mss + HEADEREXTSIZE)
+            continue;
+        
+        segment temp;
+        if (!temp.decode(seg_buf, n)) {
+            // corrupted on the way, let the server retransmit it
+            badSegments++;
+            continue;
+        }
+        // echo a CE mark until the server says it has cut its window
+        if (temp.getFlagcwr())
+            ceEcho = false;
+        if (gro_ecn == ECN_CE) {
+            ceEcho = true;
+            ceMarks++;
+        }
+        
+        int len = temp.getDataLen();    // payload bytes in this segment
+        if (temp.getFlagprobe()) {
+            replyToProbe(sockfd, serveraddr, len);
+            continue;
+        }
+        
+        unsigned char* seg_data = temp.getData();
+        unsigned char unpacked[proto::max_data];
+        if (temp.getFlagcomp()) {
+            len = lz4_decompress(seg_data, len, unpacked, proto::max_data);
+            if (len < 0) {
+                badSegments++;
+                continue;
+            }
+            seg_data = unpacked;
+        }
+        
+        uint16_t recv_seq = temp.getSeqnum();
+        
+        // a repair segment stands in for the one segment of its block we
+        // are missing, if there is exactly one
+        unsigned char rebuilt[proto::max_data];
+        if (temp.getFlagfec()) {
+            trace() << "Receiving packet " << recv_seq << " FEC" << endl;
+            if (!fec)
+                continue;
+            long start = streamOffset(recv_seq, NextExpSeq, delivered);
+            if (temp.getFlaglap() != lapOf(seq_base, start))
+                continue;   // a block a lap old
+            int blocklen = proto::seq(temp.getAcknum() - recv_seq);
+            long rebuilt_off;
+            int rebuilt_len;
+            if (!fec_dec.rebuild(start, blocklen, temp.getRcvwin(), seg_data, len,
+                                 rebuilt, rebuilt_off, rebuilt_len))
+                continue;
+            recv_seq = proto::seq(recv_seq + (rebuilt_off - start));
+            seg_data = rebuilt;
+            len = rebuilt_len;
+            recovered++;
+        }
+        else {
+            trace() << "Receiving packet " << recv_seq << endl;
+            // a copy from a lap ago, of data written long since
+            if (temp.getFlaglap() != lapOf(seq_base, streamOffset(recv_seq, NextExpSeq, delivered))) {
+                replyWithAck(sockfd, serveraddr, NextExpSeq, lapOf(seq_base, delivered), true);
+                continue;
+            }
+        }
+
+        if (temp.getFlagfin()) {
+            // the FIN comes right after the data of its segment
+            fin_offset = streamOffset(recv_seq, NextExpSeq, delivered) + len;
+            if (temp.getFlagdigest()) {
+                has_digest = true;
+                expected_crc = ((uint32_t)temp.getAcknum() << 16) | temp.getRcvwin();
+            }
+        }
+        
+        long off = streamOffset(recv_seq, NextExpSeq, delivered);
+        if (fec)
+            fec_dec.store(off, seg_data, len);
+        
+        // drop the part we already have in order, and the part that does not fit
+        if (off < delivered) {
+            int skip = (int)(delivered - off) < len ? (int)(delivered - off) : len;
+            seg_data += skip;
+            len -= skip;
+            off += skip;
+        }
+        long fits = bufferEnd();
+        if (fits > delivered + RCVBUFSIZE)
+            fits = delivered + RCVBUFSIZE;
+        if (off + len > fits)
+            len = (int)(fits - off);
+        
+        // CASE 1: nothing new, or data doesn't fit into buffer,
+        // discard data, and send desired Seq immediately
+        if (len <= 0 && off != delivered) {
+            int t = replyWithAck(sockfd, serveraddr, NextExpSeq, lapOf(seq_base, delivered), true);
+            if (t < 0)
+                perror("sendto");
+            continue;
+        }
+        
+        // store the data into its chunks
+        int buf_pos = proto::ring(off);
+        store(off, seg_data, len);
+        mark_rwnd(buf_pos, len, true);
+        
+        // CASE 2: out of order, but data fits into buffer,
+        // send desired Seq immediately
+        if (off != delivered) {
+            replyWithAck(sockfd, serveraddr, NextExpSeq, lapOf(seq_base, delivered), true);
+            continue;
+        }
+        
+        // CASE 3: in order packet,
+        // deliver up to the first byte not received yet
+        int ready = consecutive_acked(buf_pos);
+        mark_rwnd(buf_pos, ready, false);
+        
+        NextExpSeq = add(NextExpSeq, ready);
+        deliver(ready);
+        if (delivered == fin_offset)
+            break;      // all in: the FIN-ACK acknowledges this
+        replyWithAck(sockfd, serveraddr, NextExpSeq, lapOf(seq_base, delivered), false);
+    }
+    
+    // the empty span ends the delivery thread; file_crc is final once it returns
+    flushWriter();
+    handOver(handed);
+    if (writerThreaded)
+        writer.join();
+    if (reopenFd >= 0)
+        close(reopenFd);
+    reopenFd = -1;
+    if (lost)
+        cerr << "ERROR in recvfrom: the stream ends at byte " << delivered << endl;
+    else if (refused)
+        cerr << "The sink refused the data from byte " << refusedAt << " on, which is lost" << endl;
+    else if (has_digest) {
+        digest_ok = (expected_crc == file_crc);
+        if (digest_ok)
+            stats() << "File digest OK" << endl;
+        else
+            cerr << "File digest MISMATCH" << endl;
+    }
+
+    // LAST_ACK: acknowledge the server's FIN along with ours, and wait a
+    // few round trips for the final ACK; the data is all written anyway.
+    // After a SYN-ACK with a FIN, the handshake ACK did that already
+    uint16_t fin_ack = add(NextExpSeq, 1);
+    if (!earlyFin && !lost)
+        replyWithFin(sockfd, serveraddr, fin_ack, false);
+    struct timeval rcv_timeout;
+    rcv_timeout.tv_sec = 0;
+    rcv_timeout.tv_usec = (long)(finTimeout * 1000000);
+    net()->setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &rcv_timeout, sizeof(rcv_timeout));
+    int fin_tries = 1;
+    while (!lost) {
+        unsigned char* seg_buf = recvSegment(sockfd, n, serveraddr, serverlen, true);
+        if (seg_buf == NULL) {
+            if ((errno != EAGAIN && errno != EWOULDBLOCK) || fin_tries >= FIN_TRIES) {
+                stats() << "No ACK for our FIN, closing" << endl;
+                break;
+            }
+            if (earlyFin)
+                net()->sendto(sockfd, handshake_ack_buf, handshake_ack_len, 0,
+                       (struct sockaddr *)&serveraddr, serverlen);
+            else
+                replyWithFin(sockfd, serveraddr, fin_ack, true);
+            fin_tries++;
+            continue;
+        }
+        segment r;
+        if (n < 8 || n > proto::max_mss + HEADEREXTSIZE || !r.decode(seg_buf, n)) {
+            badSegments++;
+            continue;
+        }
+        if (r.getFlagack() && !r.getFlagsyn() && r.getAcknum() == add(INIT_SEQ_NUM, 2))
+            break;
+        // the server repeats its FIN: our FIN-ACK got lost
+        if (r.getFlagfin())
+            replyWithFin(sockfd, serveraddr, fin_ack, true);
+    }
+    close(sockfd);
+    sockfd = -1;
+
+    if (badSegments > 0)
+        stats() << badSegments << " corrupted segments dropped" << endl;
+    if (recovered > 0)
+        stats() << recovered << " segments rebuilt from FEC" << endl;
+    if (ceMarks > 0)
+        stats() << ceMarks << " segments marked CE" << endl;
+    if (groReads > 0)
+        stats() << groSegments << " segments received in " << groReads << " GRO reads" << endl;
+    dataLatency.report(stats(), "Segment");
+    return lost ? 3 : (refused ? 2 : (digest_ok ? 0 : 1));
+    
+}
+
+// a sink fed spans: each is written out and released at once
+struct sink_writer : transport::span_sink {
+    transport::sink &out;
+
+    explicit sink_writer(transport::sink &out) : out(out) {}
+
+    bool take(const transport::span &s) {
+        if (!out.write(s.data, s.len)) {
+            perror("write");
+            return false;
+        }
+        s.release();
+        return true;
+    }
+};
+
+}
+
+/* The library's face of the receiver: it sets the globals above from the
+ options, then runs the same code ./client does. */
+
+namespace transport {
+
+file_sink::file_sink(const char* path)
+{
+    fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0)
+        perror("open");
+}
+
+file_sink::~file_sink()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+bool file_sink::write(const unsigned char* data, long n)
+{
+    while (n > 0) {
+        ssize_t w = ::write(fd, data, n);
+        if (w < 0)
+            return false;
+        data += w;
+        n -= w;
+    }
+    return true;
+}
+
+Connection::Connection(const char* host, const char* port, const options& opts)
+{
+    receiver::checksum = opts.checksum;
+    receiver::spinUs = opts.spin_us;
+    receiver::cpus = opts.cpus;
+    receiver::logging = opts.log;
+    if (!opts.cpus.empty() && (errno = pin_thread(opts.cpus[0])) != 0)
+        perror("pin_thread");
+    connected = receiver::connectServer(host, port) == 0;
+}
+
+int Connection::receive(sink& out)
+{
+    if (!connected)
+        return 3;
+    receiver::sink_writer writer(out);
+    return receiver::receiveInto(writer);
+}
+
+int Connection::receive(span_sink& out)
+{
+    if (!connected)
+        return 3;
+    return receiver::receiveInto(out);
+}
+
+void span::release() const
+{
+    if (receiver::chunks[chunk].refs.fetch_sub(1, std::memory_order_release) != 1)
+        return;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (receiver::windowShut.exchange(false))
+        eventfd_write(receiver::reopenFd, 1);
+}
+
+}
@@ -0,0 +1,1563 @@
+#include "tcp.hpp"
+#include "fec.hpp"
+#include "siphash.hpp"
+#include "spsc.hpp"
+#include "netio.hpp"
+#include "isn.hpp"
+#include "addr.hpp"
+#include "busypoll.hpp"
+#include "blockcache.hpp"
+#include "ecn.hpp"
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <map>
+#include <deque>
+#include <poll.h>
+#include <getopt.h>
+#include <thread>
+#include <sched.h>
+#include <signal.h>
+#include "transport.hpp"
+
+namespace sender {
+
+uint16_t server_seq;
+uint16_t server_ack;
+uint16_t client_ack;
+
+enum {SLOWSTART, CONGESTIONADVOIDANCE, FASTRECOVERY};
+
+int state = SLOWSTART;
+int ssthresh = proto::ssthresh;
+int cwnd = proto::init_window;  // congestion window in bytes
+int rwnd = proto::window;       // the client's receive window, from its latest ACK
+double persistTimeout = 0;      // zero-window probe interval, 0 while the window is open
+int segSize = DATASIZE;         // payload bytes per segment
+int peerMaxData = DATASIZE;     // largest payload the client accepts
+double timeout = proto::init_rto;
+#define RTO_GRANULARITY 0.005   // least margin of the timeout over the RTT (RFC 6298's G)
+#define RTO_MAX 60.0            // most the timeout backs off to (RFC 6298, 2.5)
+double estimatedRTT, devRTT, adaptiveRTO;
+bool ackLap = false;    // RSV_LAP of server_ack, see lapOf()
+uint16_t handshake_client_sequence;
+uint64_t cookie_key[2]; // secret for SYN cookies, new every run
+uint64_t connId = 0;    // from conn_id() once the handshake is done, for the log
+bool zeroRtt = false;   // send the start of the file with the SYN-ACK
+int earlyLen = 0;       // file bytes carried by the SYN-ACK
+bool earlyWhole = false;    // they are the whole file: the SYN-ACK carries the FIN too
+bool earlyFin = false;  // and the handshake ACK was the client's FIN-ACK
+bool checksum = false;  // attach a CRC32C to every segment sent
+uint32_t file_crc = 0;  // CRC32C of the file bytes read so far
+long badSegments = 0;
+bool compress = false;  // LZ4 each segment, if the client can decompress
+int compressMiss = 0;   // segments in a row that did not compress
+int compressSkip = 0;   // segments left to send without trying
+long rawBytes = 0, wireBytes = 0;
+bool fec = false;       // send XOR repair segments, if the client can use them
+fec_encoder fec_enc;
+double lossRate = 0.0;  // moving average of loss episodes per segment sent
+bool ecn = false;       // send ECN-capable datagrams, if the client echoes marks
+bool cwrPending = false;    // the next new segment tells the client the window was cut
+long ecnCuts = 0;       // window cuts for ECN echoes
+long repairsSent = 0;
+long retransmits = 0;   // segments sent again, on a timeout or three duplicate ACKs
+
+int spinUs = 0;         // busy-poll this long before sleeping, 0 to sleep at once
+vector<int> cpus;       // cores for the protocol thread and the reader, if pinned
+latency_log ackLatency;
+bool logging = true;    // every packet to stdout, what a transfer came to on stderr
+
+inline ostream& trace() { return logTo(cout, logging); }
+inline ostream& stats() { return logTo(cerr, logging); }
+
+/* A reader thread keeps the file RBLOCKS blocks ahead of the sender, so
+ the main loop never waits on the disk: it copies what the reader has
+ queued in read_ring and moves on if that is nothing yet. The reader also
+ folds the bytes into file_crc, which is complete once the main loop has
+ taken the last block. A block of length 0 marks the end of the file,
+ one of length -1 a read error. Where net() allows no threads the main
+ loop reads each block itself when the ring runs empty.
+
+ The source may also be a stream of unknown length, such as a pipe or a
+ socket: the reader then read()s it in order, once, and its end is the
+ first read() that returns nothing. As a slow disk, or a stream, can keep
+ the sender waiting for any length of time, the reader signals readyFd as
+ it queues each block, so the main loop can sleep on that. */
+#define RBLOCKSIZE 65536
+#define RBLOCKS 8
+struct file_block {
+    long len;
+    unsigned char data[RBLOCKSIZE];
+};
+spsc_ring<file_block, RBLOCKS> read_ring;
+long pullOffset = 0;    // bytes of the front block already taken
+int inlineFd = -1;      // the file, when pullFile reads it itself
+long readOffset = 0;    // of the next block to read
+bool streaming = false; // the source is no regular file: read() it, once
+bool sourceEnd = false; // pullFile reached the end of the source
+bool readFailed = false;    // or a read of it that failed
+int readyFd = -1;       // eventfd the reader signals as it queues a block
+long cacheMB = -1;      // with -m, serve clients concurrently
+bool forked = false;    // this is the child serving one of them
+
+/* With -m the server forks a process per client, and the readers of all
+ of them go through one block cache (blockcache.hpp) of the size given. */
+block_cache cache;
+cache_file fileKey;
+
+// reads the next block of the file into slot b of read_ring
+// @returns false once the end of the file or an error is queued
+bool readBlock(int fd, file_block *b)
+{
+    if (streaming)
+    {
+        do
+            b->len = read(fd, b->data, RBLOCKSIZE);
+        while (b->len == -1 && errno == EINTR);
+    }
+    else if (cache.on())
+        b->len = cache.pread(fd, fileKey, readOffset, b->data, RBLOCKSIZE);
+    else
+        b->len = pread(fd, b->data, RBLOCKSIZE, readOffset);
+    if (b->len > 0)
+    {
+        file_crc = crc32c(file_crc, b->data, b->len);
+        readOffset += b->len;
+    }
+    read_ring.push();
+    if (readyFd >= 0)
+        eventfd_write(readyFd, 1);
+    return b->len > 0;
+}
+
+void readerThread(int fd)
+{
+    if (!cpus.empty())
+        pin_thread(cpus.back());
+    while (true)
+    {
+        if (!readBlock(fd, read_ring.wait_back()))
+            return;
+    }
+}
+
+/* Copies up to n bytes of the file from read_ring to dst.
+ @returns the bytes copied, fewer than n if the reader is behind */
+long pullFile(unsigned char *dst, long n)
+{
+    long copied = 0;
+    while (copied < n)
+    {
+        file_block *b = read_ring.front();
+        if (b == NULL && inlineFd >= 0)
+        {
+            readBlock(inlineFd, read_ring.back());
+            b = read_ring.front();
+        }
+        if (b == NULL)
+            break;
+        if (b->len == 0)
+        {
+            sourceEnd = true;
+            break;
+        }
+        if (b->len < 0)
+        {
+            readFailed = true;
+            break;
+        }
+        long take = b->len - pullOffset;
+        if (take > n - copied)
+            take = n - copied;
+        memcpy(dst + copied, b->data + pullOffset, take);
+        copied += take;
+        pullOffset += take;
+        if (pullOffset == b->len)
+        {
+            read_ring.pop();
+            pullOffset = 0;
+        }
+    }
+    return copied;
+}
+
+/* Packetization layer path MTU discovery (RFC 4821 style): once connected
+ the server sends padded probe segments of the sizes below, which the
+ client echoes back. Each echoed probe raises segSize; a size that goes
+ unanswered three times ends the search. Probes carry no data. */
+const int probe_sizes[] = {1440, 3840, 7680, proto::max_data};
+const int num_probe_sizes = sizeof(probe_sizes) / sizeof(probe_sizes[0]);
+int probeIndex = 0;         // next entry of probe_sizes to try
+int probeTries = 0;
+bool probeOutstanding = false;
+double probeTime;
+int timeoutsInRow = 0;
+
+/* UDP generic segmentation offload: segments of one size sent back to back
+ are gathered in gso_buf and handed to the kernel with a single sendmsg
+ carrying UDP_SEGMENT, which cuts them apart again below the socket layer
+ (or in the NIC). Only the last segment of a batch may be shorter. On a
+ kernel without GSO the first batch fails and every segment after that is
+ sent on its own. */
+#define GSO_MAXSEGS 64          // the kernel's limit per send
+#define GSO_MAXBYTES 65000      // stay under the largest UDP datagram
+bool gso = true;
+unsigned char gso_buf[GSO_MAXBYTES];
+int gso_len = 0;        // bytes gathered
+int gso_size = 0;       // size of every segment in the batch but the last
+int gso_count = 0;      // segments gathered
+long gsoBatches = 0, gsoSegments = 0;
+
+// seconds on a clock that never steps back, virtual under the simulator
+double monotonicNow()
+{
+    return net()->now();
+}
+
+/* Sends the segments gathered in gso_buf. */
+void flushSegments(int sockfd, struct sockaddr_storage &clientaddr, socklen_t clientlen)
+{
+    if (gso_count == 0)
+        return;
+    
+    bool sent = false;
+#ifdef UDP_SEGMENT
+    if (gso && gso_count > 1)
+    {
+        struct iovec iov;
+        iov.iov_base = gso_buf;
+        iov.iov_len = gso_len;
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        memset(control, 0, sizeof(control));
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &clientaddr;
+        msg.msg_namelen = clientlen;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t size = (uint16_t)gso_size;
+        memcpy(CMSG_DATA(cm), &size, sizeof(size));
+        
+        if (net()->sendmsg(sockfd, &msg, 0) != -1)
+        {
+            sent = true;
+            gsoBatches++;
+            gsoSegments += gso_count;
+        }
+        else if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)
+            gso = false;
+    }
+#endif
+    for (int off = 0; !sent && off < gso_len; off += gso_size)
+    {
+        int len = gso_len - off < gso_size ? gso_len - off : gso_size;
+        net()->sendto(sockfd, gso_buf + off, len, 0, (struct sockaddr *)&clientaddr, clientlen);
+    }
+    gso_len = gso_count = 0;
+}
+
+/* Queues an encoded segment for flushSegments, sending what is gathered
+ first if the segment cannot join the batch. */
+void queueSegment(int sockfd, struct sockaddr_storage &clientaddr, socklen_t clientlen,
+                  unsigned char *buf, int len)
+{
+    if (!gso)
+    {
+        net()->sendto(sockfd, buf, len, 0, (struct sockaddr *)&clientaddr, clientlen);
+        return;
+    }
+    if (gso_count > 0 && (len > gso_size || gso_len % gso_size != 0 ||
+                          gso_count == GSO_MAXSEGS || gso_len + len > GSO_MAXBYTES))
+        flushSegments(sockfd, clientaddr, clientlen);
+    if (gso_count == 0)
+        gso_size = len;
+    memcpy(gso_buf + gso_len, buf, len);
+    gso_len += len;
+    gso_count++;
+}
+
+//acked bytes were newly acknowledged
+void updateCwnd(int acked)
+{
+    switch (state)
+    {
+        case SLOWSTART:
+        {
+            cwnd += acked;
+            if (cwnd >= ssthresh)
+                state = CONGESTIONADVOIDANCE;
+            break;
+        }
+        case CONGESTIONADVOIDANCE:
+        {
+            int inc = (int)((long)segSize * acked / cwnd);
+            cwnd += inc > 0 ? inc : 1;
+            break;
+        }
+        case FASTRECOVERY:
+        {
+            cwnd = ssthresh;
+            state = CONGESTIONADVOIDANCE;
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/* Compresses size bytes of data into packed. Returns the compressed size,
+ or 0 if the segment should go out as is. After 8 misses in a row it stops
+ trying for a while, so incompressible files cost next to no CPU. */
+int packPayload(unsigned char *data, int size, unsigned char *packed)
+{
+    if (!compress || size == 0)
+        return 0;
+    if (compressSkip > 0)
+    {
+        compressSkip--;
+        return 0;
+    }
+    
+    int packed_size = lz4_compress(data, size, packed, size - 1);
+    if (packed_size > 0)
+        compressMiss = 0;
+    else if (++compressMiss >= 8)
+        compressSkip = 64;
+    return packed_size;
+}
+
+/* Number of data segments the next repair segment covers. One repair
+ rebuilds one loss per block, so the block shrinks as losses get more
+ frequent, and never outgrows the congestion window. */
+int fecBlockSize()
+{
+    int k = FEC_MAXK;
+    if (lossRate > 0.0 && 1.0 / (2.0 * lossRate) < k)
+        k = (int)(1.0 / (2.0 * lossRate));
+    if (k > cwnd / segSize)
+        k = cwnd / segSize;
+    return k < 2 ? 2 : k;
+}
+
+//a segment left the sender (lost = false) or was found lost (lost = true)
+void updateLossRate(bool lost)
+{
+    lossRate = 0.98 * lossRate + (lost ? 0.02 : 0.0);
+}
+
+// RSV_LAP for seq, which lies within half the sequence space of server_ack
+bool seqLap(uint16_t seq)
+{
+    int diff = proto::seq(seq - server_ack);
+    if (diff <= proto::window)
+        return ackLap != (seq < server_ack);
+    return ackLap != (seq > server_ack);
+}
+
+/* Sends the repair segment for the current block and starts a new one. */
+void sendRepair(int sockfd, struct sockaddr_storage &clientaddr, socklen_t clientlen)
+{
+    segment seg;
+    seg.setSeqnum(fec_enc.start);
+    seg.setAcknum(fec_enc.end);
+    seg.setRcvwin((uint16_t)fec_enc.stride);
+    seg.setFlagfec();
+    if (seqLap(fec_enc.start))
+        seg.setFlaglap();
+    if (checksum)
+        seg.setFlagcsum();
+    unsigned char *send_buf = seg.encode(fec_enc.parity, fec_enc.stride);
+    queueSegment(sockfd, clientaddr, clientlen, send_buf, seg.getLength());
+    
+    trace() << "Sending packet " << fec_enc.start << " " << cwnd << " " << ssthresh << " FEC" << endl;
+    repairsSent++;
+    fec_enc.reset();
+    fec_enc.k = fecBlockSize();
+}
+
+/* Sends send_size bytes starting at ptr in the circular file buffer
+ as a single segment with sequence number seq. First transmissions
+ (fresh = true) are folded into the current FEC block. With fin set
+ the segment also carries the FIN, right after its data; send_size
+ may then be 0. */
+void sendSegment(int sockfd, struct sockaddr_storage &clientaddr, socklen_t clientlen,
+                 unsigned char *file_buf, unsigned char *ptr, uint16_t seq, int send_size,
+                 bool fresh, bool fin)
+{
+    segment seg;
+    seg.setSeqnum(seq);
+    if (seqLap(seq))
+        seg.setFlaglap();
+    if (checksum)
+        seg.setFlagcsum();
+    if (cwrPending && fresh && send_size > 0)
+    {
+        seg.setFlagcwr();
+        cwrPending = false;
+    }
+    if (fin)
+    {
+        seg.setFlagfin();
+        if (checksum)
+        {
+            // let the client check the whole file against what we read
+            seg.setFlagdigest();
+            seg.setAcknum((file_crc >> 16) & 0xFFFF);
+            seg.setRcvwin(file_crc & 0xFFFF);
+        }
+    }
+    
+    unsigned char temp[proto::max_data];
+    unsigned char *data = ptr;
+    if (ptr + send_size > file_buf + proto::window)
+    {
+        long send_part2 = (ptr + send_size) - (file_buf + proto::window);
+        long send_part1 = send_size - send_part2;
+        memcpy((char*)temp, (char*)ptr, send_part1);
+        memcpy((char*)(temp+send_part1), (char*)file_buf, send_part2);
+        data = temp;
+    }
+    if (fec && fresh)
+    {
+        if (!fec_enc.fits(send_size))
+            sendRepair(sockfd, clientaddr, clientlen);
+        fec_enc.add(seq, data, send_size);
+    }
+    
+    unsigned char *send_buf;
+    unsigned char packed[proto::max_data];
+    int packed_size = packPayload(data, send_size, packed);
+    if (packed_size > 0)
+    {
+        seg.setFlagcomp();
+        send_buf = seg.encode(packed, packed_size);
+    }
+    else
+        send_buf = seg.encode(data, send_size);
+    
+    rawBytes += send_size;
+    wireBytes += seg.getDataLen();
+    queueSegment(sockfd, clientaddr, clientlen, send_buf, seg.getLength());
+}
+
+/* Sends the next path MTU probe once the previous one is answered, or
+ counts it lost after a retransmission timeout. */
+void probePath(int sockfd, struct sockaddr_storage &clientaddr, socklen_t clientlen)
+{
+    if (probeIndex >= num_probe_sizes)
+        return;
+    int size = probe_sizes[probeIndex] < peerMaxData ? probe_sizes[probeIndex] : peerMaxData;
+    if (size <= segSize)
+    {
+        probeIndex = num_probe_sizes;
+        return;
+    }
+    
+    if (probeOutstanding)
+    {
+        if (monotonicNow() - probeTime < timeout)
+            return;
+        probeOutstanding = false;
+        if (++probeTries >= 3)
+        {
+            probeIndex = num_probe_sizes;
+            return;
+        }
+    }
+    
+    unsigned char pad[proto::max_data];
+    memset(pad, 0, size);
+    segment seg;
+    seg.setSeqnum(server_seq);
+    seg.setFlagprobe();
+    if (checksum)
+        seg.setFlagcsum();
+    unsigned char *send_buf = seg.encode(pad, size);
+    if (net()->sendto(sockfd, send_buf, seg.getLength(), 0, (struct sockaddr *)&clientaddr, clientlen) == -1)
+    {
+        // larger than the local interface allows, no point going on
+        if (errno == EMSGSIZE)
+            probeIndex = num_probe_sizes;
+        else
+            perror("sendto");
+        return;
+    }
+    probeOutstanding = true;
+    probeTime = monotonicNow();
+}
+
+/* The client echoed a probe with size bytes of payload. */
+void probeAcked(int size)
+{
+    if (!probeOutstanding || probeIndex >= num_probe_sizes)
+        return;
+    int expected = probe_sizes[probeIndex] < peerMaxData ? probe_sizes[probeIndex] : peerMaxData;
+    if (size != expected)
+        return;
+    
+    segSize = size;
+    probeOutstanding = false;
+    probeTries = 0;
+    probeIndex++;
+    stats() << "Segment size raised to " << segSize << endl;
+}
+
+/* SYN cookies: the server's initial sequence number is a keyed hash of the
+ client's address, port and initial sequence number and a coarse clock,
+ so answering a SYN takes no state at all. Only the handshake ACK, which
+ must acknowledge a cookie from this period or the last one, and which
+ repeats the options of the SYN, opens the connection. */
+#define COOKIE_PERIOD_BITS 6    // a cookie is good for 64 to 128 seconds
+
+uint16_t synCookie(const struct sockaddr_storage &addr, uint16_t client_isn, uint32_t period)
+{
+    unsigned char msg[24];
+    addr_bytes(msg, addr);
+    msg[18] = (client_isn >> 8) & 0xFF;
+    msg[19] = client_isn & 0xFF;
+    msg[20] = (period >> 24) & 0xFF;
+    msg[21] = (period >> 16) & 0xFF;
+    msg[22] = (period >> 8) & 0xFF;
+    msg[23] = period & 0xFF;
+    return proto::seq(siphash24(cookie_key, msg, sizeof(msg)));
+}
+
+/* Takes on the options a SYN, or the handshake ACK repeating it, asks for. */
+void acceptSynOptions(segment &syn)
+{
+    // the client asks for checksums by sending a checksummed SYN
+    if (syn.getFlagcsum())
+        checksum = true;
+    // only compress for clients that say they can decompress
+    if (!syn.getFlagcomp())
+        compress = false;
+    if (!syn.getFlagfec())
+        fec = false;
+    if (!syn.getFlagece() || !syn.getFlagcwr())
+        ecn = false;
+    
+    rwnd = syn.getRcvwin() < proto::window ? syn.getRcvwin() : proto::window;
+    
+    // take larger segments only from clients that say they can
+    uint16_t mss;
+    if (getOption16(syn.getData(), syn.getDataLen(), OPT_MSS, mss))
+    {
+        peerMaxData = mss < proto::max_data ? mss : proto::max_data;
+        if (peerMaxData < DATASIZE)
+            peerMaxData = DATASIZE;
+    }
+}
+
+/* Answers a SYN from a client built for another profile (profile.hpp)
+ with a RST, which carries the MSS and sequence number width of this
+ build so the client can say what it met. */
+void refuseSyn(int sockfd, struct sockaddr_storage &clientaddr, socklen_t clientlen, segment &syn)
+{
+    unsigned char options[SYN_OPTSIZE];
+    int optlen = putOption16(options, 0, OPT_MSS, proto::max_data);
+    optlen = putOption16(options, optlen, OPT_SEQBITS, proto::seq_bits);
+    // the two builds wrap sequence numbers differently: echo the SYN's
+    // number as it came rather than acknowledge it
+    segment rst;
+    rst.setAcknum(syn.getSeqnum());
+    rst.setFlagack();
+    rst.setFlagrst();
+    unsigned char *rst_buf = rst.encode(options, optlen);
+    net()->sendto(sockfd, rst_buf, rst.getLength(), 0, (struct sockaddr *) &clientaddr, clientlen);
+    trace() << "Sending packet RST" << endl;
+    stats() << "Refused a client built for another profile" << endl;
+}
+
+// whether isn is the cookie for client_isn from addr, this period or the last
+bool cookieValid(const struct sockaddr_storage &addr, uint16_t client_isn, uint16_t isn, uint32_t period)
+{
+    return isn == synCookie(addr, client_isn, period) || isn == synCookie(addr, client_isn, period - 1);
+}
+
+/*  The server answers SYNs with a SYN cookie until a client sends a
+ handshake ACK that carries a valid one, and returns that client's
+ next sequence number. With zeroRtt the SYN-ACK also carries the first
+ earlyLen bytes of the file, which the ACK must acknowledge; a stream has
+ none to spare, since its first bytes may be a long time coming. So as
+ not to answer a forged source with much more than it sent, they go only
+ with a SYN at least a third the size of the SYN-ACK, which the client
+ pads its SYNs to be. When they are the whole file, and the client wants
+ no digest (which a FIN carries where the SYN-ACK has its ackNo), the
+ SYN-ACK carries the FIN as well, and the handshake ACK may be the
+ client's FIN-ACK: the transfer is then over in one round trip. */
+uint16_t handshake(int sockfd, struct sockaddr_storage &clientaddr, socklen_t clientlen, int fd)
+{
+    unsigned char handshake_buf[proto::max_mss+HEADEREXTSIZE];
+    unsigned char early[DATASIZE];
+    
+    if (zeroRtt && !streaming)
+    {
+        long n = pread(fd, early, DATASIZE, 0);
+        if (n == -1)
+            perror("pread");
+        earlyLen = n > 0 ? (int)n : 0;
+        struct stat st;
+        earlyWhole = fstat(fd, &st) == 0 && st.st_size == earlyLen;
+    }
+    
+    while (true)
+    {
+        long recv_len = net()->recvfrom(sockfd, handshake_buf, sizeof(handshake_buf), 0,
+                                 (struct sockaddr *) &clientaddr, &clientlen);
+        if (recv_len < HEADERSIZE)
+        {
+            if (recv_len == -1)
+                perror("recvfrom");
+            continue;
+        }
+        
+        segment seg;
+        if (!seg.decode(handshake_buf, (int)recv_len))
+        {
+            badSegments++;
+            continue;
+        }
+        uint32_t period = (uint32_t)monotonicNow() >> COOKIE_PERIOD_BITS;
+        
+        if (seg.getFlagsyn() && !seg.getFlagack())
+        {
+            // a client built for another profile would misread every
+            // number we send it: refuse it at once
+            if (!profileMatches(seg.getData(), seg.getDataLen()))
+            {
+                refuseSyn(sockfd, clientaddr, clientlen, seg);
+                continue;
+            }
+            // send syn-ack, remembering nothing; a lost one is
+            // retransmitted when the client repeats its SYN
+            uint16_t isn = synCookie(clientaddr, seg.getSeqnum(), period);
+            segment synack;
+            synack.setSeqnum(isn);
+            setReplyAck(seg, synack, 1);
+            synack.setFlagsyn();
+            synack.setFlagack();
+            if (checksum || seg.getFlagcsum())
+                synack.setFlagcsum();
+            if (compress && seg.getFlagcomp())
+                synack.setFlagcomp();
+            if (fec && seg.getFlagfec())
+                synack.setFlagfec();
+            if (ecn && seg.getFlagece() && seg.getFlagcwr())
+                synack.setFlagece();
+            int headers = HEADERSIZE + (synack.getFlagcsum() ? HEADEREXTSIZE : 0);
+            int sent = headers + earlyLen <= 3 * recv_len ? earlyLen : 0;
+            if (sent == earlyLen && earlyWhole && !synack.getFlagcsum())
+                synack.setFlagfin();
+            
+            unsigned char *synack_buf = synack.encode(early, sent);
+            net()->sendto(sockfd, synack_buf, synack.getLength(), 0,
+                   (struct sockaddr *) &clientaddr, clientlen);
+            trace() << "Sending packet " << isn << " " << cwnd << " " << ssthresh << " SYN" << endl;
+            continue;
+        }
+        if (!seg.getFlagack() || seg.getFlagsyn())
+            continue;
+        
+        // receive ack: it acknowledges the cookie, plus the early data
+        // unless its SYN was too small for them, plus our FIN if that came
+        int fin = seg.getFlagfin() ? 1 : 0;
+        uint16_t client_isn = proto::seq(seg.getSeqnum() - 1);
+        int sent = earlyLen;
+        uint16_t isn = proto::seq(seg.getAcknum() - 1 - sent - fin);
+        if (!cookieValid(clientaddr, client_isn, isn, period))
+        {
+            sent = 0;
+            isn = proto::seq(seg.getAcknum() - 1 - fin);
+            if (!cookieValid(clientaddr, client_isn, isn, period))
+                continue;
+        }
+        if (fin && !(earlyWhole && sent == earlyLen))
+            continue;   // we sent no FIN for it to acknowledge
+        
+        trace() << "Receiving packet " << seg.getAcknum() << (fin ? " FIN" : "") << endl;
+        acceptSynOptions(seg);
+        earlyLen = sent;
+        earlyFin = fin;
+        server_seq = server_ack = proto::seq(isn + 1 + earlyLen);
+        ackLap = lapOf(proto::seq(isn + 1), earlyLen);
+        client_ack = seg.getSeqnum();
+        return client_ack;
+    }
+}
+
+/* TIME_WAIT: after its last ACK the server stays around for a short while
+ to answer a retransmitted FIN-ACK, in case that ACK was lost. Every entry
+ waits the same time, so the queue is always ordered by expiry. */
+#define FIN_RETRIES 8           // FIN retransmissions before giving up
+#define TIME_WAIT_MIN 0.05      // bounds on the time spent in TIME_WAIT, seconds
+#define TIME_WAIT_MAX 1.0
+
+struct TimeWait {
+    struct sockaddr_storage addr;
+    uint16_t finSeq;     // sequence number of the client's FIN
+    double expires;      // on the monotonic clock, seconds
+};
+deque<TimeWait> time_wait;
+
+// acknowledges the client's FIN, which came with the ACK of ours
+void sendFinalAck(int sockfd, struct sockaddr_storage &clientaddr, socklen_t clientlen, uint16_t finSeq)
+{
+    segment ack;
+    ack.setSeqnum(server_seq);
+    ack.setAcknum(proto::seq(finSeq + 1));
+    ack.setFlagack();
+    if (checksum)
+        ack.setFlagcsum();
+    unsigned char *ack_buf = ack.encode(NULL, 0);
+    net()->sendto(sockfd, ack_buf, ack.getLength(), 0, (struct sockaddr *) &clientaddr, clientlen);
+}
+
+/* Answers FIN-ACKs from connections in TIME_WAIT until the last of them
+ expires. */
+void drainTimeWait(int sockfd)
+{
+    unsigned char recv[proto::max_mss+HEADEREXTSIZE];
+    while (!time_wait.empty())
+    {
+        double left = time_wait.front().expires - monotonicNow();
+        if (left <= 0)
+        {
+            time_wait.pop_front();
+            continue;
+        }
+        
+        struct pollfd pfd;
+        pfd.fd = sockfd;
+        pfd.events = POLLIN;
+        if (net()->poll(&pfd, 1, (int)(left * 1000) + 1) <= 0)
+            continue;
+        
+        struct sockaddr_storage from;
+        socklen_t fromlen = sizeof(from);
+        long n = net()->recvfrom(sockfd, recv, sizeof(recv), MSG_DONTWAIT, (struct sockaddr *) &from, &fromlen);
+        segment r;
+        if (n < HEADERSIZE || !r.decode(recv, (int)n) || !r.getFlagfin() || !r.getFlagack())
+            continue;
+        for (size_t i = 0; i < time_wait.size(); i++)
+        {
+            TimeWait &tw = time_wait[i];
+            if (addr_equal(tw.addr, from) && tw.finSeq == r.getSeqnum())
+                sendFinalAck(sockfd, from, fromlen, tw.finSeq);
+        }
+    }
+}
+
+/* Opens a UDP socket on port, IPv6 unless the kernel has none, and binds
+ it to any address of that family, which it stores in serveraddr. IPv4
+ clients reach an IPv6 socket too, and show up v4-mapped. The port can be
+ shared, for the connected sockets of forked children.
+ @returns the socket, or -1 */
+int serverSocket(int &family, int portno, struct sockaddr_storage &serveraddr)
+{
+    family = AF_INET6;
+    int sockfd = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (sockfd < 0 && errno == EAFNOSUPPORT)
+    {
+        family = AF_INET;
+        sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    }
+    if (sockfd < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+    
+    int optval = 0;
+    if (family == AF_INET6 &&
+        net()->setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &optval, sizeof(int)) == -1)
+        perror("setsockopt");
+    
+    optval = 1;
+    if (net()->setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval , sizeof(int)) == -1 ||
+        net()->setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval , sizeof(int)) == -1){
+        perror("setsockopt");
+        close(sockfd);
+        return -1;
+    };
+    
+#ifdef IP_MTU_DISCOVER
+    // never fragment: probes larger than the path must be lost, not split
+    optval = IP_PMTUDISC_PROBE;
+    if (net()->setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &optval, sizeof(int)) == -1)
+        perror("setsockopt");
+#endif
+#ifdef IPV6_MTU_DISCOVER
+    optval = IPV6_PMTUDISC_PROBE;
+    if (family == AF_INET6 &&
+        net()->setsockopt(sockfd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &optval, sizeof(int)) == -1)
+        perror("setsockopt");
+#endif
+    
+    // stamp arrivals, for the latency report; busy-poll if asked to
+    optval = 1;
+    if (net()->setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &optval, sizeof(int)) == -1)
+        perror("setsockopt");
+    if (spinUs > 0 && busy_poll_socket(sockfd, spinUs) == -1)
+        perror("SO_BUSY_POLL");
+    
+    /* build the server's Internet address: any, of the socket's family */
+    bzero((char *) &serveraddr, sizeof(serveraddr));
+    if (family == AF_INET6)
+    {
+        struct sockaddr_in6 *any = (struct sockaddr_in6 *) &serveraddr;
+        any->sin6_family = AF_INET6;
+        any->sin6_addr = in6addr_any;
+        any->sin6_port = htons((unsigned short)portno);
+    }
+    else
+    {
+        struct sockaddr_in *any = (struct sockaddr_in *) &serveraddr;
+        any->sin_family = AF_INET;
+        any->sin_addr.s_addr = htonl(INADDR_ANY);
+        any->sin_port = htons((unsigned short)portno);
+    }
+    
+    /* bind: associate the socket with the port */
+    if (::bind(sockfd, (struct sockaddr *) &serveraddr, addr_len(serveraddr)) == -1){
+        perror("bind");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/* @returns our end of sockfd's connection to clientaddr, as getsockname()
+ gives it: of sockfd itself once it is connected, as in a child of -m.
+ The socket all clients share is bound to any address, so for it a
+ socket of its own is connected to the client, to learn which address
+ the kernel sends from, and our port put with that. */
+struct sockaddr_storage localEnd(int sockfd, const struct sockaddr_storage &clientaddr)
+{
+    struct sockaddr_storage local;
+    socklen_t len = sizeof(local);
+    memset(&local, 0, sizeof(local));
+    if (net()->getsockname(sockfd, (struct sockaddr *) &local, &len) == -1 || !addr_any(local))
+        return local;
+    struct sockaddr_storage routed;
+    len = sizeof(routed);
+    int fd = socket(clientaddr.ss_family, SOCK_DGRAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &clientaddr, addr_len(clientaddr)) == 0 &&
+        getsockname(fd, (struct sockaddr *) &routed, &len) == 0 && routed.ss_family == local.ss_family)
+    {
+        if (local.ss_family == AF_INET6)
+            ((struct sockaddr_in6 *) &routed)->sin6_port = ((struct sockaddr_in6 *) &local)->sin6_port;
+        else
+            ((struct sockaddr_in *) &routed)->sin_port = ((struct sockaddr_in *) &local)->sin_port;
+        local = routed;
+    }
+    if (fd >= 0)
+        close(fd);
+    return local;
+}
+
+/* Opens what the server sends: standard input for "-", a connection to
+ the listening Unix socket at path, or the file at path, which may be a
+ FIFO or a device. @returns the descriptor, or -1 */
+int openSource(const char *path)
+{
+    struct stat st;
+    if (strcmp(path, "-") == 0)
+        return dup(STDIN_FILENO);
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        struct sockaddr_un un;
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        strncpy(un.sun_path, path, sizeof(un.sun_path) - 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (struct sockaddr *) &un, sizeof(un)) == -1)
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    return open(path, O_RDONLY);
+}
+
+/* Puts back the state a transfer leaves behind, so that a process can
+ serve one after another. The options are set again by the Listener. */
+void newTransfer()
+{
+    server_seq = server_ack = client_ack = 0;
+    state = SLOWSTART;
+    ssthresh = proto::ssthresh;
+    cwnd = proto::init_window;
+    rwnd = proto::window;
+    persistTimeout = 0;
+    segSize = peerMaxData = DATASIZE;
+    timeout = proto::init_rto;
+    estimatedRTT = devRTT = adaptiveRTO = 0;
+    ackLap = false;
+    connId = 0;
+    earlyLen = 0;
+    earlyWhole = earlyFin = false;
+    file_crc = 0;
+    badSegments = 0;
+    compressMiss = compressSkip = 0;
+    rawBytes = wireBytes = 0;
+    fec_enc.reset();
+    lossRate = 0.0;
+    cwrPending = false;
+    ecnCuts = repairsSent = retransmits = 0;
+    ackLatency = latency_log();
+    
+    // the block that ended the last source, at its end or a failed read, is still queued
+    while (read_ring.front() != NULL)
+        read_ring.pop();
+    pullOffset = 0;
+    inlineFd = -1;
+    readOffset = 0;
+    streaming = sourceEnd = readFailed = false;
+    readyFd = -1;
+    
+    probeIndex = probeTries = 0;
+    probeOutstanding = false;
+    timeoutsInRow = 0;
+    gso_len = gso_size = gso_count = 0;
+    gsoBatches = gsoSegments = 0;
+}
+
+/* Sends what fd reads to a client of sockfd, bound to serveraddr on
+ portno; with cacheMB, to every client, each in a process of its own.
+ Anything but a regular file is a stream, sent to one client, up to the
+ end read() finds. Unacknowledged data stays in file_buf, so nothing is
+ ever read twice.
+ @returns 0 once the client has it all, or what ./server exits with */
+int serveFile(int sockfd, int family, int portno, struct sockaddr_storage &serveraddr, int fd)
+{
+    struct sockaddr_storage clientaddr; /* client addr */
+    socklen_t clientlen; /* byte size of client's address */
+    unsigned char file_buf[proto::window];
+    unsigned long lastbyteSent, lastbyteAcked, maxbyte;
+    unsigned char *lastbyteSentPtr, *lastbyteAckedPtr, *maxbytePtr;
+    double clock_start, clock_end;
+    bool eof = false;
+    int dupAck = 0;
+    map<uint16_t, double> time_map;
+    unsigned char recv_buf[proto::max_mss+HEADEREXTSIZE];
+    
+    clientlen = sizeof(clientaddr);
+    newTransfer();
+    
+    struct stat st;
+    if (fstat(fd, &st) == -1){
+        perror("fstat");
+        return 5;
+    }
+    streaming = !S_ISREG(st.st_mode);
+    if (streaming && cacheMB >= 0)
+    {
+        cerr << "A stream goes to one client only, -m ignored" << endl;
+        cacheMB = -1;
+    }
+    
+    net()->key(cookie_key);
+    if (cacheMB > 0 && (!fileKey.of(fd) || !cache.open(cacheMB)))
+        perror("block cache");
+    if (cacheMB >= 0)
+        signal(SIGCHLD, SIG_IGN);   // nobody waits for the children
+    
+    /* with -m, a child per client: the parent goes back to answering SYNs,
+     the child takes over the transfer on a socket connected to the
+     client, which the kernel prefers for the client's datagrams */
+    bool ask_checksum = checksum, ask_compress = compress, ask_fec = fec, ask_ecn = ecn;
+    int ask_peerMaxData = peerMaxData;
+    while (true)
+    {
+        if (handshake(sockfd, clientaddr, clientlen, fd) == USHRT_MAX)
+            return 3;
+        if (cacheMB < 0)
+            break;
+        pid_t pid = fork();
+        if (pid == -1)
+            perror("fork");
+        if (pid == 0)
+        {
+            forked = true;
+            close(sockfd);
+            if ((sockfd = serverSocket(family, portno, serveraddr)) == -1)
+                return 2;
+            if (connect(sockfd, (struct sockaddr *) &clientaddr, addr_len(clientaddr)) == -1)
+            {
+                perror("connect");
+                return 2;
+            }
+            break;
+        }
+        // the next client negotiates from scratch
+        checksum = ask_checksum;
+        compress = ask_compress;
+        fec = ask_fec;
+        ecn = ask_ecn;
+        peerMaxData = ask_peerMaxData;
+    }
+    if (ecn && set_ect(sockfd) == -1)
+        perror("IP_TOS");
+    struct sockaddr_storage localaddr = localEnd(sockfd, clientaddr);
+    connId = conn_id(localaddr, clientaddr);
+    stats() << "Connection " << hex << connId << dec << " from " << addr_str(clientaddr)
+            << " to " << addr_str(localaddr) << endl;
+    
+    // the client already has the bytes that rode on the SYN-ACK
+    if (earlyLen > 0 && pread(fd, file_buf, earlyLen, 0) != earlyLen){
+        perror("pread");
+        return 6;
+    }
+    file_crc = crc32c(file_crc, file_buf, earlyLen);
+    readOffset = earlyLen;
+    if (net()->threads() && (readyFd = eventfd(0, EFD_NONBLOCK)) == -1)
+        perror("eventfd");
+    std::thread reader;
+    if (net()->threads())
+        reader = std::thread(readerThread, fd);
+    else
+        inlineFd = fd;
+    
+    maxbyte = lastbyteSent = lastbyteAcked = earlyLen;
+    maxbytePtr = lastbyteSentPtr = lastbyteAckedPtr = file_buf + earlyLen;
+    clock_start = clock_end = monotonicNow();
+    // the handshake ACK acknowledged the early data, and opens the window as any ACK
+    if (earlyLen > 0)
+        updateCwnd(earlyLen);
+    
+    bool firstRTT = true;
+    fec_enc.k = fecBlockSize();
+    
+    bool finSent = earlyFin;    // the FIN went out, after the last data byte
+    bool finAcked = earlyFin;   // and the client acknowledged it, sending its own
+    uint16_t finSeq = server_seq;   // sequence number the FIN takes
+    uint16_t clientFinSeq = client_ack;
+    int finRetries = 0;
+    double finTime = monotonicNow();    // when the FIN first went out
+    unsigned long recover = 0;  // end of what was in flight at the last timeout
+    unsigned long ecnRecover = 0;   // end of what was in flight at the last ECN cut
+    
+    while (!finAcked)
+    {
+        // in flight: no more than the network, nor the client, can take
+        unsigned long wnd = cwnd < rwnd ? cwnd : rwnd;
+        while ((lastbyteSent < maxbyte) && (lastbyteSent - lastbyteAcked < wnd))
+        {
+            int send_size = segSize;
+            if (lastbyteAcked + rwnd - lastbyteSent < (unsigned long)send_size)
+                send_size = (int)(lastbyteAcked + rwnd - lastbyteSent);
+            if (maxbyte - lastbyteSent < (unsigned long)send_size)
+                send_size = (int)(maxbyte - lastbyteSent);
+            // only the end of the file goes out in a short segment, unless
+            // nothing else is in flight (no silly windows)
+            if (send_size < segSize && !(eof && lastbyteSent + send_size == maxbyte) &&
+                lastbyteSent != lastbyteAcked)
+                break;
+            
+            // the last data segment carries the FIN; below recover we go
+            // over ground already covered, and time nothing (Karn)
+            bool fin = eof && lastbyteSent + send_size == maxbyte;
+            bool again = lastbyteSent < recover;
+            // the retransmission timer runs while anything is in flight
+            if (lastbyteSent == lastbyteAcked)
+                clock_start = monotonicNow();
+            sendSegment(sockfd, clientaddr, clientlen, file_buf, lastbyteSentPtr, server_seq, send_size,
+                        !again, fin);
+            if (lastbyteSentPtr + send_size > file_buf + proto::window)
+                lastbyteSentPtr = lastbyteSentPtr + send_size - proto::window;
+            else
+                lastbyteSentPtr = lastbyteSentPtr + send_size;
+            
+            if (again)
+                retransmits++;
+            else
+                time_map[server_seq] = monotonicNow();
+            
+            trace() << "Sending packet " << server_seq << " " << cwnd << " " << ssthresh
+            << (again ? " Retransmission" : "") << (fin ? " FIN" : "") << endl;
+            server_seq = proto::seq(server_seq + send_size);
+            lastbyteSent += send_size;
+            if (fin && !finSent)
+            {
+                finSent = true;
+                finSeq = server_seq;
+                finTime = monotonicNow();
+            }
+            
+            if (fec)
+            {
+                updateLossRate(false);
+                if (fec_enc.count >= fec_enc.k)
+                    sendRepair(sockfd, clientaddr, clientlen);
+            }
+        }
+        
+        // protect the tail of the file too, a partial block is better than none
+        if (fec && fec_enc.count > 0 && eof && lastbyteSent == maxbyte)
+            sendRepair(sockfd, clientaddr, clientlen);
+        
+        // no data segment left to carry the FIN, it goes on its own
+        if (eof && lastbyteSent == maxbyte && !finSent)
+        {
+            if (lastbyteSent == lastbyteAcked)
+                clock_start = monotonicNow();
+            sendSegment(sockfd, clientaddr, clientlen, file_buf, lastbyteSentPtr, server_seq, 0,
+                        false, true);
+            trace() << "Sending packet " << server_seq << " " << cwnd << " " << ssthresh << " FIN" << endl;
+            finSent = true;
+            finSeq = server_seq;
+            finTime = monotonicNow();
+        }
+        flushSegments(sockfd, clientaddr, clientlen);
+        
+        if (!eof || lastbyteSent < maxbyte)
+            probePath(sockfd, clientaddr, clientlen);
+        
+        double arrival = 0;     // of the datagram in hand, by the kernel's stamp
+        bool heard = false;     // anything read since the last send
+        while (true)
+        {
+            ackLatency.add(arrival);
+            arrival = 0;
+            
+            struct iovec iov;
+            iov.iov_base = recv_buf;
+            iov.iov_len = sizeof(recv_buf);
+            char control[CMSG_SPACE(sizeof(struct timespec))];
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_name = &clientaddr;
+            msg.msg_namelen = sizeof(clientaddr);
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            
+            long recv_len;
+            if ((recv_len = net()->recvmsg(sockfd, &msg, MSG_DONTWAIT)) == -1)
+            {
+                if (errno != EWOULDBLOCK && errno != EAGAIN)
+                    perror("recvmsg");
+                // nothing yet: we sleep until an ACK comes or a timer is
+                // due, or, if we have sent all the reader had and the
+                // window would take more, until it queues more. Without a
+                // reader thread, pullFile below reads for itself
+                if (heard)
+                    break;
+                bool starved = !eof && maxbyte - lastbyteSent < (unsigned long)segSize &&
+                               lastbyteSent - lastbyteAcked < wnd;
+                if (starved && readyFd < 0)
+                    break;
+                struct pollfd pfd[2];
+                pfd[0].fd = sockfd;
+                pfd[0].events = POLLIN;
+                pfd[1].fd = readyFd;
+                pfd[1].events = POLLIN;
+                pfd[1].revents = 0;
+                int ms = -1;    // no timer runs with nothing in flight
+                if (lastbyteSent > lastbyteAcked || finSent || rwnd == 0)
+                {
+                    double due = clock_start + (persistTimeout > 0 ? persistTimeout : timeout) - monotonicNow();
+                    ms = due > 0 ? (int)(due * 1000) + 1 : 0;
+                }
+                busy_wait(pfd, starved ? 2 : 1, ms, spinUs);
+                eventfd_t ready;
+                if (pfd[1].revents & POLLIN)
+                    eventfd_read(readyFd, &ready);
+                break;
+            }
+            clientlen = msg.msg_namelen;
+            arrival = arrival_of(msg);
+            heard = true;
+            if (recv_len < HEADERSIZE)
+                continue;
+            
+            segment ack;
+            if (!ack.decode(recv_buf, (int)recv_len))
+            {
+                badSegments++;
+                continue;
+            }
+            if (ack.getFlagprobe())
+            {
+                // the client echoes the probe size in the sequence number
+                probeAcked(ack.getSeqnum());
+                continue;
+            }
+            if (ack.getFlagack())
+            {
+                trace() << "Receiving packet " << ack.getAcknum() << endl;
+                
+                uint16_t diff = proto::seq(ack.getAcknum() - server_ack);
+                if (finSent && ack.getFlagfin() && ack.getAcknum() == proto::seq(finSeq + 1))
+                {
+                    // FIN-ACK: the client has everything and closes too
+                    finAcked = true;
+                    clientFinSeq = ack.getSeqnum();
+                    break;
+                }
+                unsigned long highest = lastbyteSent > recover ? lastbyteSent : recover;
+                if (diff > highest - lastbyteAcked)
+                    continue;   // older than what is already acknowledged
+                // a full window ACK reads the same as one a lap old, delayed
+                if (ack.getFlaglap() != seqLap(ack.getAcknum()))
+                    continue;
+                rwnd = ack.getRcvwin() < proto::window ? ack.getRcvwin() : proto::window;
+                if (rwnd > 0)
+                    persistTimeout = 0;
+                
+                // a queue on the path marked our data: back off as for a
+                // loss, but with nothing to resend, and once per window
+                // (RFC 3168), not again while recovering from a loss
+                if (ecn && ack.getFlagece() && state != FASTRECOVERY &&
+                    lastbyteAcked >= ecnRecover && lastbyteAcked >= recover)
+                {
+                    ssthresh = cwnd/2 < segSize ? segSize : cwnd/2;
+                    cwnd = ssthresh;
+                    state = CONGESTIONADVOIDANCE;
+                    ecnRecover = lastbyteSent;
+                    cwrPending = true;
+                    ecnCuts++;
+                }
+                
+                if (ack.getAcknum() != server_ack)
+                {
+                    map<uint16_t, double>::iterator it = time_map.find(server_ack);
+                    if (it != time_map.end())
+                    {
+                        double now, then;
+                        now = monotonicNow();
+                        then = it->second;
+                        time_map.erase(server_ack);
+                        
+                        double sampleRTT = now - then;
+                        
+                        if (firstRTT)
+                        {
+                            estimatedRTT = sampleRTT;
+                            devRTT = sampleRTT / 2;
+                            adaptiveRTO = estimatedRTT + (4 * devRTT > RTO_GRANULARITY ?
+                                                          4 * devRTT : RTO_GRANULARITY);
+                            timeout = adaptiveRTO;
+                            firstRTT = false;
+                        }
+                        else
+                        {
+                            double difference = sampleRTT - estimatedRTT >= 0 ?
+                                                sampleRTT - estimatedRTT : estimatedRTT - sampleRTT;
+                            estimatedRTT = 0.875 * estimatedRTT + 0.125 * sampleRTT;
+                            devRTT = 0.75 * devRTT + 0.25 * difference;
+                            adaptiveRTO = estimatedRTT + (4 * devRTT > RTO_GRANULARITY ?
+                                                          4 * devRTT : RTO_GRANULARITY);
+                            timeout = adaptiveRTO;
+                        }
+                    }
+                    
+                    lastbyteAcked += diff;
+                    if (lastbyteAckedPtr + diff > file_buf + proto::window)
+                        lastbyteAckedPtr = lastbyteAckedPtr + diff - proto::window;
+                    else
+                        lastbyteAckedPtr = lastbyteAckedPtr + diff;
+                    
+                    if (ack.getAcknum() < server_ack)
+                        ackLap = !ackLap;
+                    server_ack = ack.getAcknum();
+                    updateCwnd(diff);
+                    
+                    // the client held on to more than we went back for
+                    if (lastbyteAcked > lastbyteSent)
+                    {
+                        lastbyteSent = lastbyteAcked;
+                        lastbyteSentPtr = lastbyteAckedPtr;
+                        server_seq = server_ack;
+                    }
+                    
+                    clock_start = clock_end = monotonicNow();
+                    dupAck = 0;
+                    timeoutsInRow = 0;
+                }
+                // going back after a timeout, resent data the client holds
+                // already brings duplicate ACKs: no sign of a new loss
+                else if (lastbyteAcked >= recover)
+                {
+                    if (state != FASTRECOVERY)
+                    {
+                        dupAck++;
+                        if (dupAck == 1)
+                            updateLossRate(true);
+                        if (dupAck == 3)
+                        {
+                            state = FASTRECOVERY;
+                            dupAck = 0;
+                            
+                            ssthresh = cwnd/2 < segSize ? segSize : cwnd/2;
+                            cwnd = ssthresh + segSize*3;
+                            
+                            // resend what is in flight, never more
+                            int send_size = segSize;
+                            if (lastbyteSent - lastbyteAcked < (unsigned long)segSize)
+                                send_size = (int)(lastbyteSent - lastbyteAcked);
+                            bool fin = finSent && lastbyteAcked + send_size == maxbyte;
+                            
+                            sendSegment(sockfd, clientaddr, clientlen, file_buf, lastbyteAckedPtr,
+                                        server_ack, send_size, false, fin);
+                            flushSegments(sockfd, clientaddr, clientlen);
+                            retransmits++;
+                            
+                            trace() << "Sending packet " << server_ack << " " << cwnd << " "
+                            << ssthresh << " Retransmission" << endl;
+                            clock_start = clock_end = monotonicNow();
+                            time_map.erase(server_ack);
+                        }
+                    }
+                    else
+                        cwnd += segSize;
+                }
+            }
+        }
+        
+        if (finAcked)
+            break;
+        
+        clock_end = monotonicNow();
+        double elapsed_secs = clock_end - clock_start;
+        
+        // zero window: nothing in flight to bring an ACK, so probe the
+        // window now and then with an empty segment, backing off
+        if (rwnd == 0 && lastbyteSent == lastbyteAcked && lastbyteSent < maxbyte)
+        {
+            if (persistTimeout == 0)
+            {
+                persistTimeout = timeout;
+                clock_start = clock_end;
+            }
+            else if (elapsed_secs >= persistTimeout)
+            {
+                sendSegment(sockfd, clientaddr, clientlen, file_buf, lastbyteSentPtr, server_seq, 0,
+                            false, false);
+                flushSegments(sockfd, clientaddr, clientlen);
+                trace() << "Sending packet " << server_seq << " " << cwnd << " " << ssthresh
+                << " Window probe" << endl;
+                persistTimeout = persistTimeout * 2 < 1.0 ? persistTimeout * 2 : 1.0;
+                clock_start = clock_end;
+            }
+        }
+        else if (elapsed_secs >= timeout && (lastbyteSent > lastbyteAcked || finSent))
+        {
+            // everything acknowledged but the FIN: the client may be gone
+            if (finSent && lastbyteAcked == maxbyte && ++finRetries > FIN_RETRIES)
+            {
+                stats() << "No FIN-ACK from the client, closing" << endl;
+                break;
+            }
+            
+            state = SLOWSTART;
+            dupAck = 0;
+            
+            // repeated timeouts after growing the segments look like a
+            // path that drops them: go back to the size that always works
+            if (++timeoutsInRow >= 3 && segSize > DATASIZE)
+            {
+                segSize = DATASIZE;
+                probeIndex = num_probe_sizes;
+                stats() << "Segment size back to " << segSize << endl;
+            }
+            
+            ssthresh = cwnd/2 < segSize ? segSize : cwnd/2;
+            cwnd = segSize;
+            updateLossRate(true);
+            
+            int send_size = segSize;
+            if (lastbyteSent - lastbyteAcked < (unsigned long)segSize)
+                send_size = (int)(lastbyteSent - lastbyteAcked);
+            bool fin = finSent && lastbyteAcked + send_size == maxbyte;
+            
+            sendSegment(sockfd, clientaddr, clientlen, file_buf, lastbyteAckedPtr,
+                        server_ack, send_size, false, fin);
+            flushSegments(sockfd, clientaddr, clientlen);
+            retransmits++;
+            
+            trace() << "Sending packet " << server_ack << " " << cwnd << " "
+            << ssthresh << " Retransmission" << endl;
+            clock_start = clock_end = monotonicNow();
+            
+            timeout = timeout * 2 < RTO_MAX ? timeout * 2 : RTO_MAX;
+            time_map.erase(server_ack);
+            
+            // go back N (RFC 5681): what followed is likely lost as well, so
+            // it goes again as ACKs open the window, not one per timeout
+            if (lastbyteSent > lastbyteAcked + send_size)
+            {
+                recover = lastbyteSent > recover ? lastbyteSent : recover;
+                lastbyteSent = lastbyteAcked + send_size;
+                if (lastbyteAckedPtr + send_size > file_buf + proto::window)
+                    lastbyteSentPtr = lastbyteAckedPtr + send_size - proto::window;
+                else
+                    lastbyteSentPtr = lastbyteAckedPtr + send_size;
+                server_seq = proto::seq(server_ack + send_size);
+                time_map.clear();
+            }
+        }
+        
+        if (maxbyte - lastbyteAcked <= proto::window)
+        {
+            long bytes_left = proto::window - (maxbyte - lastbyteAcked);
+            long bytes_read;
+            if (proto::window-(maxbytePtr-file_buf) < (bytes_left))
+            {
+                unsigned long part1 = proto::window - (maxbytePtr - file_buf);
+                unsigned long part2 = bytes_left - part1;
+                bytes_read = pullFile(maxbytePtr, part1);
+                if (bytes_read == (long)part1)
+                    bytes_read += pullFile(file_buf, part2);
+            }
+            else
+            {
+                bytes_read = pullFile(maxbytePtr, bytes_left);
+            }
+            
+            maxbyte += bytes_read;
+            if (maxbytePtr + bytes_read > file_buf + proto::window)
+                maxbytePtr = maxbytePtr + bytes_read - proto::window;
+            else
+                maxbytePtr = maxbytePtr + bytes_read;
+            
+            if (sourceEnd)
+                eof = true;
+            // the client gets no FIN for a file we could not read to its end
+            if (readFailed)
+                break;
+        }
+    }
+    
+    if (finAcked)
+    {
+        // acknowledge the client's FIN, then linger in TIME_WAIT; one on
+        // the handshake ACK was logged with it
+        if (!earlyFin)
+            trace() << "Receiving packet " << proto::seq(finSeq + 1) << " FIN" << endl;
+        sendFinalAck(sockfd, clientaddr, clientlen, clientFinSeq);
+        // long enough for the client to repeat a FIN-ACK: it waits
+        // a few round trips for our ACK, so linger for several too
+        double linger = 8 * (monotonicNow() - finTime);
+        linger = linger < TIME_WAIT_MIN ? TIME_WAIT_MIN : (linger > TIME_WAIT_MAX ? TIME_WAIT_MAX : linger);
+        TimeWait tw;
+        tw.addr = clientaddr;
+        tw.finSeq = clientFinSeq;
+        tw.expires = monotonicNow() + linger;
+        time_wait.push_back(tw);
+        drainTimeWait(sockfd);
+    }
+    
+    // the reader is done: it queued the end of the file we sent a FIN at
+    if (reader.joinable())
+        reader.join();
+    if (readyFd >= 0)
+        close(readyFd);
+    if (readFailed)
+    {
+        cerr << "ERROR reading file" << endl;
+        return 7;
+    }
+    
+    if (retransmits > 0)
+        stats() << retransmits << " segments retransmitted" << endl;
+    if (badSegments > 0)
+        stats() << badSegments << " segments dropped on checksum mismatch" << endl;
+    if (compress && rawBytes > 0)
+        stats() << "Compressed " << rawBytes << " bytes to " << wireBytes << endl;
+    if (fec)
+        stats() << repairsSent << " FEC repair segments sent" << endl;
+    if (ecnCuts > 0)
+        stats() << ecnCuts << " window cuts on ECN marks" << endl;
+    if (gsoBatches > 0)
+        stats() << gsoSegments << " segments sent in " << gsoBatches << " GSO batches" << endl;
+    if (cache.on())
+        stats() << "Block cache: " << cache.hits << " hits, " << cache.misses << " misses; "
+        << cache.total_hits() << " hits, " << cache.total_misses() << " misses, "
+        << cache.total_evictions() << " evictions in all" << endl;
+    ackLatency.report(stats(), "ACK");
+    return 0;
+}
+
+}
+
+/* The library's face of the sender: it sets the globals above from the
+ options, then runs the same code ./server does. A transfer changes some
+ of them as it negotiates, so they are set again for every one. */
+
+namespace transport {
+
+static void configure(const options& opts)
+{
+    sender::checksum = opts.checksum;
+    sender::compress = opts.compress;
+    sender::fec = opts.fec;
+    sender::ecn = opts.ecn;
+    sender::zeroRtt = opts.zero_rtt;
+    sender::spinUs = opts.spin_us;
+    sender::cpus = opts.cpus;
+    sender::cacheMB = opts.cache_mb;
+    sender::logging = opts.log;
+}
+
+Listener::Listener(int port, const options& opts) : port(port), opts(opts)
+{
+    configure(opts);
+    if (!opts.cpus.empty() && (errno = pin_thread(opts.cpus[0])) != 0)
+        perror("pin_thread");
+    sockfd = sender::serverSocket(family, port, addr);
+}
+
+Listener::~Listener()
+{
+    if (sockfd >= 0)
+        close(sockfd);
+}
+
+int Listener::serve(const char* path)
+{
+    int fd = sender::openSource(path);
+    if (fd == -1)
+    {
+        perror("open");
+        return 4;
+    }
+    int rc = serve(fd);
+    close(fd);
+    return rc;
+}
+
+int Listener::serve(int fd)
+{
+    if (sockfd < 0)
+        return 2;
+    configure(opts);
+    int rc = sender::serveFile(sockfd, family, port, addr, fd);
+    // a child forked for one client ends with its transfer, here rather
+    // than in the application, which the parent goes on running
+    if (sender::forked)
+    {
+        cout.flush();
+        cerr.flush();
+        _exit(rc);
+    }
+    return rc;
+}
+
+}
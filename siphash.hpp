@@ -0,0 +1,78 @@
+#ifndef SIPHASH_HPP
+#define SIPHASH_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+/* SipHash-2-4 (Aumasson and Bernstein), a keyed hash that is fast on short
+ inputs and cannot be steered by someone who does not know the key. Used
+ wherever a value sent on the wire must not be guessable, like SYN cookies. */
+
+#define SIP_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIP_ROUND(v0, v1, v2, v3) \
+  do { \
+    v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+    v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+  } while(0)
+
+inline uint64_t siphash24(const uint64_t key[2], const unsigned char* p, size_t n)
+{
+  uint64_t v0 = 0x736f6d6570736575ULL ^ key[0];
+  uint64_t v1 = 0x646f72616e646f6dULL ^ key[1];
+  uint64_t v2 = 0x6c7967656e657261ULL ^ key[0];
+  uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+
+  const unsigned char* end = p + (n & ~(size_t)7);
+  for ( ; p != end; p += 8){
+    uint64_t m = 0;
+    for (int i = 0; i < 8; i++){
+      m |= (uint64_t)p[i] << (8 * i);   //little endian whatever the host
+    }
+    v3 ^= m;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+
+  uint64_t b = (uint64_t)n << 56;
+  for (int i = (int)(n & 7) - 1; i >= 0; i--){
+    b |= (uint64_t)p[i] << (8 * i);
+  }
+  v3 ^= b;
+  SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3);
+  v0 ^= b;
+
+  v2 ^= 0xff;
+  SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+//fills key with secret random bits, once per process
+inline void siphash_key(uint64_t key[2])
+{
+  int fd = open("/dev/urandom", O_RDONLY);
+  if(fd >= 0){
+    ssize_t n = read(fd, key, 2 * sizeof(uint64_t));
+    close(fd);
+    if(n == 2 * sizeof(uint64_t)){
+      return;
+    }
+  }
+  //no urandom: weak, but still differs between runs and processes
+  struct timeval time;
+  gettimeofday(&time, NULL);
+  key[0] = ((uint64_t)time.tv_sec << 20) ^ time.tv_usec ^ ((uint64_t)getpid() << 32);
+  key[1] = SIP_ROTL(key[0], 29) * 0x9e3779b97f4a7c15ULL;
+}
+
+#endif
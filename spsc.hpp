@@ -0,0 +1,131 @@
+#ifndef SPSC_HPP
+#define SPSC_HPP
+
+#include <atomic>
+#include <climits>
+#include <stddef.h>
+#include <stdint.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* A lock-free ring of N slots (N a power of two) joining exactly one
+ producer thread to one consumer thread. The producer fills the slot at
+ the tail in place and publishes it with push(); the consumer works on the
+ slot at the head in place and hands it back with pop(). Nothing is copied
+ and nothing is locked: each index is written by one side only, and each
+ side keeps a cached copy of the other side's index so it touches the
+ shared cache line only when the ring looks full or empty.
+
+ A side that has to wait, the consumer on an empty ring or the producer
+ on a full one, spins a little and then sleeps on a futex, which the
+ other side's next push() or pop() wakes. The two never wait at once,
+ since the ring cannot be empty and full, so one futex serves both. */
+
+template <typename T, size_t N>
+class spsc_ring {
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "N must be a power of two");
+
+public:
+  spsc_ring() : head(0), tail_cache(0), tail(0), head_cache(0), wakes(0), sleeping(0) {}
+
+  //producer: the slot to fill next, NULL while the ring is full
+  T* back(){
+    size_t t = tail.load(std::memory_order_relaxed);
+    if(t - head_cache == N){
+      head_cache = head.load(std::memory_order_acquire);
+      if(t - head_cache == N){
+        return NULL;
+      }
+    }
+    return &slots[t & (N - 1)];
+  }
+
+  //producer: back(), waiting for the consumer while the ring is full
+  T* wait_back(){
+    T* slot;
+    for(int idle = 0; (slot = back()) == NULL; idle++)
+      hold(idle, [this]{ return back() == NULL; });
+    return slot;
+  }
+
+  //producer: hands the slot from back() to the consumer
+  void push(){
+    tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    wake();
+  }
+
+  //producer: slots it may still fill, the one from back() included
+  size_t free_slots(){
+    head_cache = head.load(std::memory_order_acquire);
+    return N - (tail.load(std::memory_order_relaxed) - head_cache);
+  }
+
+  //consumer: the oldest published slot, NULL while the ring is empty
+  T* front(){
+    size_t h = head.load(std::memory_order_relaxed);
+    if(h == tail_cache){
+      tail_cache = tail.load(std::memory_order_acquire);
+      if(h == tail_cache){
+        return NULL;
+      }
+    }
+    return &slots[h & (N - 1)];
+  }
+
+  //consumer: front(), waiting for the producer while the ring is empty
+  T* wait_front(){
+    T* slot;
+    for(int idle = 0; (slot = front()) == NULL; idle++)
+      hold(idle, [this]{ return front() == NULL; });
+    return slot;
+  }
+
+  //consumer: gives the slot from front() back to the producer
+  void pop(){
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    wake();
+  }
+
+private:
+  //spins, yields, then sleeps until the other side moves, if still_blocked()
+  //holds once we have said we are going to
+  template <typename F>
+  void hold(int idle, F still_blocked){
+    if(idle < 64){
+      return;
+    }
+    if(idle < 128){
+      sched_yield();
+      return;
+    }
+    uint32_t seen = wakes.load(std::memory_order_acquire);
+    sleeping.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(still_blocked()){
+      syscall(SYS_futex, &wakes, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    }
+    sleeping.store(0, std::memory_order_relaxed);
+  }
+
+  //after moving an index: wakes the other side if it sleeps, or is about to
+  void wake(){
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(sleeping.load(std::memory_order_relaxed)){
+      wakes.fetch_add(1, std::memory_order_release);
+      syscall(SYS_futex, &wakes, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+  }
+
+  //each index on its own cache line, next to the cache its owner uses
+  alignas(64) std::atomic<size_t> head;
+  size_t tail_cache;    // consumer's copy of tail
+  alignas(64) std::atomic<size_t> tail;
+  size_t head_cache;    // producer's copy of head
+  alignas(64) std::atomic<uint32_t> wakes;  // the futex: bumped to wake a sleeper
+  std::atomic<uint32_t> sleeping;           // a side sleeps on it, or is about to
+  alignas(64) T slots[N];
+};
+
+#endif
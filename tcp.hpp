@@ -1,3 +1,6 @@
+#ifndef TCP_HPP
+#define TCP_HPP
+
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -10,18 +13,40 @@
 #include <iostream>
 #include <string>
 #include <sys/time.h>
+#include "crc32c.hpp"
+#include "lz4block.hpp"
 
 using namespace std;
 
-#define MSS 1032    // The maximum packet size including all the headers
-#define INIT_WINDOW_SIZE 1024 // Initial window size: 1024 byte
-#define MAX_SEQ_NUM 30720 // Maximum sequence number: 30 Kbytes
-#define MAX_SEQ_NUM_HALF 15360
-#define SSTHRESH 15360   // Initial slow start threshold: 30 Kbytes
-#define RETRANS_TIMEOUT 500 // Retransmission time out value: 500 ms
-#define BUFSIZE 1024
-#define DATASIZE 1024
+#define DATASIZE 1024  // payload of a segment until the MSS is negotiated up
 #define HEADERSIZE 8
+#define HEADEREXTSIZE 4 // Optional CRC32C extension following the header
+
+#include "profile.hpp"
+
+// the sequence space, window and largest segment: see profile.hpp
+#ifndef TRANSPORT_PROFILE
+#define TRANSPORT_PROFILE default_profile
+#endif
+typedef TRANSPORT_PROFILE proto;
+
+// bits of the reserved byte
+#define RSV_CSUM 0x80   // a CRC32C of header and payload follows the header
+#define RSV_DIGEST 0x40 // on a FIN: ackNo, rcvWin hold the CRC32C of the whole file
+#define RSV_COMP 0x20   // payload is an LZ4 block; on a SYN: can decompress
+#define RSV_FEC 0x10    // XOR repair segment; on a SYN: can rebuild from one
+#define RSV_PROBE 0x08  // path MTU probe, or the reply to one
+#define RSV_LAP 0x04    // data, repair or ACK: seqNo (ackNo for an ACK) is in an odd lap
+#define RSV_ECE 0x02    // ACK: data came marked CE; on a SYN, with RSV_CWR: can do ECN
+#define RSV_CWR 0x01    // data: the window was cut for an ECE; on a SYN: see RSV_ECE
+
+// options carried in the payload of a SYN, in TCP's kind-length-value layout
+#define OPT_END 0
+#define OPT_MSS 2       // largest payload the sender of the SYN accepts
+#define OPT_SEQBITS 3   // bits the sender of the SYN counts sequence numbers in
+#define SYN_OPTSIZE 8   // both of the above, as a SYN, handshake ACK or RST carries them
+#define SYN_PADDING 352 // a SYN's payload, the options then OPT_END: a third of a SYN-ACK
+                        // with DATASIZE bytes of early data, the most a server answers with
 
 inline void error (string msg)
 {
@@ -29,6 +54,13 @@ inline void error (string msg)
   exit(1);
 }
 
+// s, or a stream that drops what it is given when on is false
+inline ostream& logTo(ostream& s, bool on)
+{
+  static ostream nowhere(NULL);
+  return on ? s : nowhere;
+}
+
 struct TcpHeader {
   uint16_t seqNo;
   uint16_t ackNo;
@@ -39,15 +71,16 @@ struct TcpHeader {
 
 struct segment {
     
-  unsigned char buffer[MSS+1];
+  unsigned char buffer[proto::max_mss+HEADEREXTSIZE+1];
   TcpHeader header;
+  int length;   // size of the encoded or decoded segment, headers included
     
   //constructor
   segment();
     
   //encode and decode
   unsigned char* encode(unsigned char* payload, int n);
-  void decode(unsigned char* buf, int n);
+  bool decode(unsigned char* buf, int n);
     
   //set functions
   void setSeqnum(uint16_t seq);
@@ -56,6 +89,15 @@ struct segment {
   void setFlagack();
   void setFlagsyn();
   void setFlagfin();
+  void setFlagrst();
+  void setFlagcsum();
+  void setFlagdigest();
+  void setFlagcomp();
+  void setFlagfec();
+  void setFlagprobe();
+  void setFlaglap();
+  void setFlagece();
+  void setFlagcwr();
     
   //get functions
   uint16_t getSeqnum();
@@ -64,25 +106,37 @@ struct segment {
   bool getFlagack();
   bool getFlagsyn();
   bool getFlagfin();
+  bool getFlagrst();
+  bool getFlagcsum();
+  bool getFlagdigest();
+  bool getFlagcomp();
+  bool getFlagfec();
+  bool getFlagprobe();
+  bool getFlaglap();
+  bool getFlagece();
+  bool getFlagcwr();
   unsigned char* getData();
+  int getDataLen();
+  int getLength();
+  int headerLen();
 };
 
 //constructor
-segment::segment(){
+inline segment::segment(){
   header.seqNo = 0x0000;
   header.ackNo = 0x0000;
-  header.rcvWin = 0x7800;
+  header.rcvWin = proto::window;
   header.reserved = 0x00;
   header.flags = 0x00;
-  memset(buffer, 0, MSS+1);
-  //buffer[MSS-1] = '\0';
+  length = HEADERSIZE;
+  //buffer is only read up to length, which encode and decode always write
 }
 
 //encode and decode
 //input is data, output is the tcp segment
-unsigned char* segment::encode(unsigned char* payload, int n){
+inline unsigned char* segment::encode(unsigned char* payload, int n){
     
-  if(n > (MSS - HEADERSIZE)){
+  if(n > proto::max_data){
     error("Input data excess the max segment size");
   }
     
@@ -108,16 +162,29 @@ unsigned char* segment::encode(unsigned char* payload, int n){
   memcpy((char*)buffer, (char*)tmp, HEADERSIZE);
     
   //encode data
+  int hdrlen = headerLen();
   if(!(payload == NULL || n==0)){
-    memcpy((char*) buffer+HEADERSIZE, (char*) payload, n);
+    memcpy((char*) buffer+hdrlen, (char*) payload, n);
+  }
+  length = hdrlen + n;
+
+  //checksum covers the header and the payload, not the checksum itself
+  if(header.reserved & RSV_CSUM){
+    uint32_t crc = crc32c(0, buffer, HEADERSIZE);
+    crc = crc32c(crc, buffer+hdrlen, n);
+    buffer[8] = (crc >> 24) & 0xFF;
+    buffer[9] = (crc >> 16) & 0xFF;
+    buffer[10] = (crc >> 8) & 0xFF;
+    buffer[11] = crc & 0xFF;
   }
     
   //return encoded result
   return buffer;
 }
 
-void segment::decode(unsigned char* buf, int n){
-  if(n > (MSS)){
+//returns false if the segment carries a checksum that does not match
+inline bool segment::decode(unsigned char* buf, int n){
+  if(n > (proto::max_mss+HEADEREXTSIZE)){
     error("Input data excess the max segment size");
   }
     
@@ -132,73 +199,201 @@ void segment::decode(unsigned char* buf, int n){
     
   //decode data
   memcpy((char*)buffer, (char*)buf, n);
+  length = n;
   //buffer[n] = '\0';
+
+  if(header.reserved & RSV_CSUM){
+    if(n < HEADERSIZE+HEADEREXTSIZE){
+      return false;
+    }
+    uint32_t expected = ((uint32_t)buf[8] << 24) | ((uint32_t)buf[9] << 16) |
+                        ((uint32_t)buf[10] << 8) | buf[11];
+    uint32_t crc = crc32c(0, buffer, HEADERSIZE);
+    crc = crc32c(crc, buffer+HEADERSIZE+HEADEREXTSIZE, n-HEADERSIZE-HEADEREXTSIZE);
+    return crc == expected;
+  }
+  return true;
 }
 
 //set functions
-void segment::setSeqnum(uint16_t seq){
+inline void segment::setSeqnum(uint16_t seq){
   header.seqNo = seq;
 }
 
-void segment::setAcknum(uint16_t ack){
+inline void segment::setAcknum(uint16_t ack){
   header.ackNo = ack;
 }
 
-void segment::setRcvwin(uint16_t rcv){
+inline void segment::setRcvwin(uint16_t rcv){
   header.rcvWin = rcv;
 }
 
-void segment::setFlagack(){
+inline void segment::setFlagack(){
   header.flags |= 0x04;
 }
 
-void segment::setFlagsyn(){
+inline void segment::setFlagsyn(){
   header.flags |= 0x02;
 }
 
-void segment::setFlagfin(){
+inline void segment::setFlagfin(){
   header.flags |=0x01;
 }
 
+//a refused SYN, whose seqNo is in ackNo: the options say what the refuser would have taken
+inline void segment::setFlagrst(){
+  header.flags |= 0x08;
+}
+
+inline void segment::setFlagcsum(){
+  header.reserved |= RSV_CSUM;
+}
+
+inline void segment::setFlagdigest(){
+  header.reserved |= RSV_DIGEST;
+}
+
+inline void segment::setFlagcomp(){
+  header.reserved |= RSV_COMP;
+}
+
+inline void segment::setFlagfec(){
+  header.reserved |= RSV_FEC;
+}
+
+inline void segment::setFlagprobe(){
+  header.reserved |= RSV_PROBE;
+}
+
+inline void segment::setFlaglap(){
+  header.reserved |= RSV_LAP;
+}
+
+inline void segment::setFlagece(){
+  header.reserved |= RSV_ECE;
+}
+
+inline void segment::setFlagcwr(){
+  header.reserved |= RSV_CWR;
+}
+
 //get functions
-uint16_t segment::getSeqnum(){
+inline uint16_t segment::getSeqnum(){
   return header.seqNo;
 }
 
-uint16_t segment::getAcknum(){
+inline uint16_t segment::getAcknum(){
   return header.ackNo;
 }
 
-uint16_t segment::getRcvwin(){
+inline uint16_t segment::getRcvwin(){
   return header.rcvWin;
 }
 
-bool segment::getFlagack(){
+inline bool segment::getFlagack(){
   if(header.flags & 0x04){
     return true;
   }
   return false;
 }
 
-bool segment::getFlagsyn(){
+inline bool segment::getFlagsyn(){
   if(header.flags & 0x02){
     return true;
   }
   return false;
 }
 
-bool segment::getFlagfin(){
+inline bool segment::getFlagfin(){
   if(header.flags & 0x01){
     return true;
   }
   return false;
 }
 
-unsigned char* segment::getData(){
-  return buffer+HEADERSIZE;
+inline bool segment::getFlagrst(){
+  if(header.flags & 0x08){
+    return true;
+  }
+  return false;
+}
+
+inline bool segment::getFlagcsum(){
+  if(header.reserved & RSV_CSUM){
+    return true;
+  }
+  return false;
+}
+
+inline bool segment::getFlagdigest(){
+  if(header.reserved & RSV_DIGEST){
+    return true;
+  }
+  return false;
+}
+
+inline bool segment::getFlagcomp(){
+  if(header.reserved & RSV_COMP){
+    return true;
+  }
+  return false;
 }
 
-void debugaux(unsigned char ch)
+inline bool segment::getFlagfec(){
+  if(header.reserved & RSV_FEC){
+    return true;
+  }
+  return false;
+}
+
+inline bool segment::getFlagprobe(){
+  if(header.reserved & RSV_PROBE){
+    return true;
+  }
+  return false;
+}
+
+inline bool segment::getFlaglap(){
+  if(header.reserved & RSV_LAP){
+    return true;
+  }
+  return false;
+}
+
+inline bool segment::getFlagece(){
+  if(header.reserved & RSV_ECE){
+    return true;
+  }
+  return false;
+}
+
+inline bool segment::getFlagcwr(){
+  if(header.reserved & RSV_CWR){
+    return true;
+  }
+  return false;
+}
+
+inline unsigned char* segment::getData(){
+  return buffer+headerLen();
+}
+
+inline int segment::getDataLen(){
+  return length-headerLen();
+}
+
+inline int segment::getLength(){
+  return length;
+}
+
+inline int segment::headerLen(){
+  if(header.reserved & RSV_CSUM){
+    return HEADERSIZE+HEADEREXTSIZE;
+  }
+  return HEADERSIZE;
+}
+
+inline void debugaux(unsigned char ch)
 {
   for (int i = 7; i >=0 ; i--)
     {
@@ -208,7 +403,7 @@ void debugaux(unsigned char ch)
   cout << endl;
 }
 
-void debug(unsigned char array[])
+inline void debug(unsigned char array[])
 {
   for (int i = 0; i < 8; i++)
     {
@@ -220,18 +415,64 @@ void debug(unsigned char array[])
  receiver: the segment to be sent
  n: the number of ack to be increased
 */
-void setReplyAck(segment &sender, segment &receiver, uint16_t n)
+inline void setReplyAck(segment &sender, segment &receiver, uint16_t n)
 {
   uint16_t seqnum = sender.getSeqnum();
-  uint16_t acknum = (seqnum+n) % MAX_SEQ_NUM;
+  uint16_t acknum = proto::seq(seqnum+n);
   receiver.setAcknum(acknum);
   receiver.setFlagack();
 }
 
-uint16_t seq_rand(uint16_t max)
+/* Appends a 16-bit option to the SYN options in buf, which hold n bytes.
+ Returns the new length of the options. */
+inline int putOption16(unsigned char* buf, int n, uint8_t kind, uint16_t value)
+{
+  buf[n] = kind;
+  buf[n+1] = 4;
+  buf[n+2] = (value >> 8) & 0xFF;
+  buf[n+3] = value & 0xFF;
+  return n + 4;
+}
+
+//finds a 16-bit option in n bytes of SYN options, returns false if absent
+inline bool getOption16(unsigned char* buf, int n, uint8_t kind, uint16_t &value)
+{
+  int i = 0;
+  while(i + 2 <= n && buf[i] != OPT_END){
+    int optlen = buf[i+1];
+    if(optlen < 2 || i + optlen > n){
+      return false;
+    }
+    if(buf[i] == kind && optlen == 4){
+      value = (buf[i+2] << 8) | buf[i+3];
+      return true;
+    }
+    i += optlen;
+  }
+  return false;
+}
+
+/* Whether the options of a SYN, n bytes in buf, fit this build: the
+ sender counts sequence numbers in as many bits, and takes segments at
+ least as large as the ones a connection starts with. */
+inline bool profileMatches(unsigned char* buf, int n)
+{
+  uint16_t bits, mss;
+  if(!getOption16(buf, n, OPT_SEQBITS, bits) || bits != proto::seq_bits)
+    return false;
+  return !getOption16(buf, n, OPT_MSS, mss) || mss >= DATASIZE;
+}
+
+/* Sequence numbers come round every proto::seq_space bytes, while half that
+ may be in flight, so a copy held up by reordering (a retransmission
+ overtaken by newer data, say) can arrive when the same number means data
+ one lap on. Data, repair segments and ACKs therefore carry the parity of
+ their lap in RSV_LAP, and a receiver drops those whose parity is not the
+ one it expects there. lapOf() gives it for stream offset off, where the
+ stream starts at sequence number base. */
+inline bool lapOf(uint16_t base, long off)
 {
-  struct timeval time; 
-  gettimeofday(&time,NULL);
-  srand((time.tv_sec * 1000) + (time.tv_usec / 1000));
-  return rand()%max;
+  return ((base + off) >> proto::seq_bits) & 1;
 }
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+
+/* libtransport: the protocol of ./server and ./client, for programs that
+ embed it. A Listener sends a file to the clients that connect to its
+ port; a Connection receives what a server sends into a sink of the
+ application's choosing, in process, with no file in between.
+
+ The protocol keeps its state in globals of the sender and receiver
+ modules (sender.cpp, receiver.cpp), so a process runs at most one
+ Listener and one Connection at a time; each transfer starts from fresh
+ state, so it may run any number of them one after another. Errors go to
+ stderr and end the transfer, never the process; the rest of what the
+ binaries print only with options::log. */
+
+namespace transport {
+
+struct options {
+  bool checksum;        // -k: CRC32C on every segment, a digest of the file
+  bool compress;        // -z (sender): LZ4, for receivers that can take it
+  bool fec;             // -f (sender): XOR repair segments
+  bool ecn;             // -e (sender): ECN-capable datagrams, cut on marks
+  bool zero_rtt;        // -0 (sender): data on the SYN-ACK
+  int spin_us;          // -p: busy-poll budget, 0 to sleep at once
+  std::vector<int> cpus;    // -c: cores for the network loop and the disk thread
+  long cache_mb;        // -m (sender): serve clients concurrently with a
+                        // cache of this size, or one client if negative
+  bool log;             // every packet to stdout and the statistics to
+                        // stderr, as the binaries print them
+
+  options() : checksum(false), compress(false), fec(false), ecn(false), zero_rtt(false),
+              spin_us(0), cache_mb(-1), log(false) {}
+};
+
+/* Where a Connection puts the data it receives: in order, exactly once,
+ on a thread of its own. */
+struct sink {
+  virtual ~sink() {}
+
+  //takes the next n bytes of the stream; false to give up on it
+  virtual bool write(const unsigned char* data, long n) = 0;
+};
+
+/* A piece of the received stream, in place in the receiver's buffers. */
+struct span {
+  const unsigned char* data;
+  long len;
+  long offset;      // of data[0] in the stream
+  int chunk;        // the buffer it lies in
+
+  /* Gives the buffer back to the receiver, once per span taken, from any
+   thread. Until then the receive window is smaller by what is held. */
+  void release() const;
+};
+
+/* Where a Connection puts the data it receives without copying it: as
+ spans, in order, exactly once, on a thread of its own. A span may be
+ kept (by value) past take() and released later; its data stays valid
+ until then, and at the latest until the next receive(). */
+struct span_sink {
+  virtual ~span_sink() {}
+
+  //takes the next span; false to give up on the stream, s and the rest
+  //of it then being released unseen
+  virtual bool take(const span& s) = 0;
+};
+
+//a file, created or truncated
+class file_sink : public sink {
+  int fd;
+
+public:
+  explicit file_sink(const char* path);
+  ~file_sink();
+  bool ok() const { return fd >= 0; }
+  bool write(const unsigned char* data, long n);
+};
+
+class Listener {
+  int sockfd;
+  int family;
+  int port;
+  struct sockaddr_storage addr;
+  options opts;
+
+public:
+  //binds port on any address, IPv6 and IPv4 where the kernel allows
+  Listener(int port, const options& opts = options());
+  ~Listener();
+  bool ok() const { return sockfd >= 0; }
+
+  /* Sends the file at path to the next client to connect. It may be
+   called again for the next client once it returns. With cache_mb it
+   serves every client until the process is killed, forking for each; a
+   child ends with its client's transfer, as _exit() with what serve()
+   would have returned, and never returns to the application. "-" is
+   standard input, and a Unix socket is connected to.
+   @returns 0 once the client has it all, else what ./server exits with
+   for the step that failed: 2 the socket, 3 the handshake, 4 opening
+   path, 5 to 7 reading it */
+  int serve(const char* path);
+
+  /* The same for what fd reads. Anything but a regular file, such as a
+   pipe or a socket, is a stream: it goes to one client, up to where
+   read() returns nothing, and with no data on the SYN-ACK. */
+  int serve(int fd);
+};
+
+class Connection {
+  bool connected;
+
+public:
+  //connects to port at host, racing its addresses (Happy Eyeballs); a
+  //process may make one Connection after another, not two at once
+  Connection(const char* host, const char* port, const options& opts = options());
+  //false if host did not resolve, or no address of it took us
+  bool ok() const { return connected; }
+
+  /* Receives the server's data into out until its FIN.
+   @returns 0, 1 if the file digest did not match, 2 if out refused some
+   of the data, or 3 if there was no connection or its socket failed, as
+   ./client exits */
+  int receive(sink& out);
+
+  //the same, handing out the data in place
+  int receive(span_sink& out);
+};
+
+}
+
+#endif